@@ -1,5 +1,7 @@
 #pragma GCC optimize ("O3")
 
+#include <string.h>
+
 #include "gnuboy.h"
 #include "defs.h"
 #include "regs.h"
@@ -15,6 +17,21 @@
 #include "asm.h"
 #endif
 
+/* Dispatch opcodes through a table of label addresses (GCC labels as
+	values) instead of a switch. GNUBOY_CPU_TRACE builds in the
+	debug_trace disassembly hook. */
+#if defined(__GNUC__) && !defined(GNUBOY_NO_THREADED_CPU)
+#define CPU_THREADED
+#endif
+
+#ifdef CPU_THREADED
+#define OP(n) op_##n
+#define OP_INVALID op_invalid
+#else
+#define OP(n) case n
+#define OP_INVALID default
+#endif
+
 
 struct cpu cpu;
 
@@ -197,16 +214,16 @@ case 0xF0|(n): SET(6, r); break; \
 case 0xF8|(n): SET(7, r); break;
 
 
-#define ALU_CASES(base, imm, op, label) \
-case (imm): b = FETCH; goto label; \
-case (base): b = B; goto label; \
-case (base)+1: b = C; goto label; \
-case (base)+2: b = D; goto label; \
-case (base)+3: b = E; goto label; \
-case (base)+4: b = H; goto label; \
-case (base)+5: b = L; goto label; \
-case (base)+6: b = readb(HL); goto label; \
-case (base)+7: b = A; \
+#define ALU_CASES(rb, rc, rd, re, rh, rl, rhl, ra, imm, op, label) \
+OP(imm): b = FETCH; goto label; \
+OP(rb): b = B; goto label; \
+OP(rc): b = C; goto label; \
+OP(rd): b = D; goto label; \
+OP(re): b = E; goto label; \
+OP(rh): b = H; goto label; \
+OP(rl): b = L; goto label; \
+OP(rhl): b = readb(HL); goto label; \
+OP(ra): b = A; \
 label: op(b); break;
 
 
@@ -230,7 +247,10 @@ label: op(b); break;
 
 #define RET ( POP(PC) )
 
-#define EI ( IMA = 1 )
+/* Ends the current run after this instruction */
+#define RESCHEDULE ( cpu.horizon = 0 )
+
+#define EI ( IMA = 1, RESCHEDULE )
 #define DI ( cpu.halt = IMA = IME = 0 )
 
 
@@ -258,6 +278,7 @@ void cpu_reset()
 	/* set lcdc ahead of cpu by 19us; see A */
 	/* FIXME: leave value at 0, use lcdc_trans() to actually send lcdc ahead */
 	cpu.lcdc = 40;
+	cpu.pending = 0;
 
 	IME = 0;
 	IMA = 0;
@@ -344,16 +365,62 @@ void IRAM_ATTR cpu_timers(int cnt)
 	sound_advance(cnt);
 }
 
+/* cpu_sync()
+	Gives the timers the time run since the last sync. Called before
+	anything reads or writes state the timers own, so that it looks as
+	if they advanced after every instruction.
+*/
+void IRAM_ATTR cpu_sync()
+{
+	if (!cpu.pending) return;
+
+	cpu_timers(cpu.pending);
+	cpu.horizon -= cpu.pending;
+	cpu.pending = 0;
+}
+
+/* cpu_horizon()
+	Time until the next event among those asked for, expressed in 2MHz
+	units
+
+	max - upper bound
+	events - interrupt flags; IF_VBLANK or IF_STAT stop at the next
+		lcdc transition, IF_TIMER at the next TIMA overflow
+*/
+static int IRAM_ATTR cpu_horizon(int max, int events)
+{
+	int cnt, unit;
+
+	/* Make sure we don't miss lcdc status events! */
+	if ((events & (IF_VBLANK | IF_STAT)) && (max > cpu.lcdc))
+		max = cpu.lcdc;
+
+	if (!((events & IF_TIMER) && (R_TAC & 0x04)))
+		return max;
+
+	/* Figure out when the next timer interrupt will happen */
+	unit = ((-R_TAC) & 3) << 1;
+	cnt = (511 - cpu.tim + (1<<unit)) >> unit;
+	cnt += (255 - R_TIMA) << (9 - unit);
+
+	/* The timer runs twice as many units in double speed */
+	cnt = (cnt + (1 << cpu.speed) - 1) >> cpu.speed;
+
+	if (max > cnt)
+		max = cnt;
+
+	return max;
+}
+
 /* cpu_idle()
 	Skip idle phase of CPU operation, if any
 
 	max - maximum time to skip expressed in 2MHz units
 	returns number of cycles skipped
 */
-/* FIXME: bring cpu_timers() out, make caller advance system */
 int IRAM_ATTR cpu_idle(int max)
 {
-	int cnt, unit;
+	int cnt;
 
 
 	if (!(cpu.halt && IME)) return 0;
@@ -363,26 +430,182 @@ int IRAM_ATTR cpu_idle(int max)
 		return 0;
 	}
 
-	/* Make sure we don't miss lcdc status events! */
-	if ((R_IE & (IF_VBLANK | IF_STAT)) && (max > cpu.lcdc))
-		max = cpu.lcdc;
+	cnt = cpu_horizon(max, R_IE);
+
+	cpu_timers(cnt);
+	return cnt;
+}
+
+/* Polling loops
+
+	Many games wait for LY, STAT or a flag set by an interrupt handler
+	in a loop such as LDH A,(44); CP n; JR NZ. When a pass through such
+	a loop ends with the registers it started with, and the loop only
+	reads state that changes at lcdc or timer events, every pass up to
+	the next event is the same, so whole passes are skipped at once.
+*/
+int cpu_pollskip;
+
+static struct cpu_stats stats;
+
+static struct
+{
+	word branch; /* address of the backward JR, 0 for none */
+	word af; /* registers when it was last taken */
+	int time; /* run time when it was last taken */
+	int event; /* run time of the next event seen then */
+	int period; /* time of one pass, 0 if the loop can't be skipped */
+} poll;
+
+void cpu_stats_get(struct cpu_stats *out)
+{
+	*out = stats;
+	memset(&stats, 0, sizeof stats);
+}
+
+/* poll_stable()
+	Whether a read from a is only changed by the CPU or at lcdc and
+	timer events
+*/
+static int IRAM_ATTR poll_stable(word a)
+{
+	if (a < 0xFF00 || a >= 0xFF80) return 1;
 
-	/* If timer interrupt cannot happen, this is very simple! */
-	if (!((R_IE & IF_TIMER) && (R_TAC & 0x04)))
+	/* DIV, TIMA and the sound registers count on their own, reading
+		SC has a side effect and the pad may change between runs */
+	a &= 0xFF;
+	return a == RI_IF || a == RI_TMA || a == RI_TAC || a >= 0x40;
+}
+
+/* poll_scan()
+	Checks that the loop from target to the JR at branch only reads
+	stable state and changes nothing but A and F
+
+	op - the JR opcode
+	returns time of one pass in 2MHz units, 0 if the loop can't be
+	skipped
+*/
+static int IRAM_ATTR poll_scan(word target, word branch, byte op)
+{
+	word a;
+	int len;
+
+	if (target > branch || branch - target > 16) return 0;
+	if (branch + 1 >= 0xFF00 && target < 0xFF80) return 0;
+
+	len = cycles_table[op];
+	for (a = target; a < branch; )
 	{
-		cpu_timers(max);
-		return max;
+		op = readb(a++);
+		len += cycles_table[op];
+		switch (op)
+		{
+		case 0x00: /* NOP */
+		case 0x2F: /* CPL */
+		case 0x78: case 0x79: case 0x7A: case 0x7B: /* LD A,r */
+		case 0x7C: case 0x7D: case 0x7F:
+		case 0xA0: case 0xA1: case 0xA2: case 0xA3: /* AND r */
+		case 0xA4: case 0xA5: case 0xA7:
+		case 0xA8: case 0xA9: case 0xAA: case 0xAB: /* XOR r */
+		case 0xAC: case 0xAD: case 0xAF:
+		case 0xB0: case 0xB1: case 0xB2: case 0xB3: /* OR r */
+		case 0xB4: case 0xB5: case 0xB7:
+		case 0xB8: case 0xB9: case 0xBA: case 0xBB: /* CP r */
+		case 0xBC: case 0xBD: case 0xBF:
+			break;
+		case 0xE6: case 0xEE: case 0xF6: case 0xFE: /* ALU A,n */
+			a++;
+			break;
+		case 0x0A: /* LD A,(BC) */
+			if (!poll_stable(BC)) return 0;
+			break;
+		case 0x1A: /* LD A,(DE) */
+			if (!poll_stable(DE)) return 0;
+			break;
+		case 0x7E: case 0xA6: case 0xAE: case 0xB6: case 0xBE: /* (HL) */
+			if (!poll_stable(HL)) return 0;
+			break;
+		case 0xF2: /* LDH A,(C) */
+			if (!poll_stable(0xFF00 + C)) return 0;
+			break;
+		case 0xF0: /* LDH A,(n) */
+			if (!poll_stable(0xFF00 + readb(a++))) return 0;
+			break;
+		case 0xFA: /* LD A,(nn) */
+			if (!poll_stable(readw(a))) return 0;
+			a += 2;
+			break;
+		case 0xCB: /* BIT b,r */
+			op = readb(a++);
+			if ((op & 0xC0) != 0x40) return 0;
+			if ((op & 7) == 6 && !poll_stable(HL)) return 0;
+			len += cb_cycles_table[op] - cycles_table[0xCB];
+			break;
+		/* Conditional exits, not taken while the loop runs */
+		case 0x20: case 0x28: case 0x30: case 0x38: /* JR cc */
+			len--;
+			a++;
+			break;
+		case 0xC2: case 0xCA: case 0xD2: case 0xDA: /* JP cc */
+			len--;
+			a += 2;
+			break;
+		case 0xC0: case 0xC8: case 0xD0: case 0xD8: /* RET cc */
+			len -= 3;
+			break;
+		default:
+			return 0;
+		}
 	}
+	if (a != branch) return 0;
 
-	/* Figure out when the next timer interrupt will happen */
-	unit = ((-R_TAC) & 3) << 1;
-	cnt = (511 - cpu.tim + (1<<unit)) >> unit;
-	cnt += (255 - R_TIMA) << (9 - unit);
+	return (len << 1) >> cpu.speed;
+}
 
-	if (max < cnt)
-		cnt = max;
+/* cpu_poll()
+	Called after the JR at branch jumped backward; skips whole passes
+	through a polling loop up to the next lcdc or timer event
 
-	cpu_timers(cnt);
+	now - run time before the JR
+	max - maximum time to skip expressed in 2MHz units
+	returns time skipped, already handed to the timers as pending
+*/
+static int IRAM_ATTR cpu_poll(word branch, byte op, int now, int max)
+{
+	int cnt, same;
+
+	/* A pass that took other than the straight way may have run
+		other code, and that code may have changed the loop */
+	if (branch != poll.branch || (poll.period && now - poll.time != poll.period))
+	{
+		poll.branch = branch;
+		poll.period = poll_scan(PC, branch, op);
+		poll.event = now;
+	}
+	if (!poll.period) return 0;
+
+	/* The pass just run is like the ones to come if it ended with the
+		registers it started with and no event came in between */
+	same = AF == poll.af && poll.event > now;
+
+	cpu_sync();
+	cnt = cpu_horizon(max, IF_VBLANK | IF_STAT | IF_TIMER);
+	poll.af = AF;
+	poll.time = now;
+	poll.event = now + cnt;
+	if (!same || IME != IMA || (IME && (IF & IE))) return 0;
+
+	/* The passes skipped must all end before the next event, as
+		they would not have stopped the run otherwise */
+	cnt--;
+	cnt -= cnt % poll.period;
+	if (cnt <= 0) return 0;
+
+	cpu.pending += cnt;
+	stats.loops++;
+	stats.skipped += cnt;
+
+	poll.time = now + cnt;
 	return cnt;
 }
 
@@ -407,9 +630,50 @@ int IRAM_ATTR cpu_emulate(int cycles)
 	static union reg acc;
 	static byte b;
 	static word w;
+#ifdef CPU_THREADED
+	static const void* const optable[256] =
+	{
+		&&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+		&&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B, &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+		&&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+		&&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B, &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+		&&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+		&&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B, &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+		&&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+		&&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B, &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+		&&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+		&&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B, &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+		&&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+		&&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B, &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+		&&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+		&&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B, &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+		&&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+		&&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B, &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+		&&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+		&&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B, &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+		&&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+		&&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B, &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+		&&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3, &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+		&&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB, &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+		&&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3, &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+		&&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB, &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+		&&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3, &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+		&&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB, &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+		&&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_invalid, &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+		&&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_invalid, &&op_0xDC, &&op_invalid, &&op_0xDE, &&op_0xDF,
+		&&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_invalid, &&op_invalid, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+		&&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_invalid, &&op_invalid, &&op_invalid, &&op_0xEE, &&op_0xEF,
+		&&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3, &&op_invalid, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+		&&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB, &&op_invalid, &&op_invalid, &&op_0xFE, &&op_0xFF
+	};
+#endif
 
 	i = cycles;
+	poll.branch = 0;
 next:
+	/* Run the event that ended the last run, if any */
+	cpu_sync();
+
 	/* Skip idle cycles */
 	if ((clen = cpu_idle(i)))
 	{
@@ -439,208 +703,225 @@ next:
 		case 0x10:
 			THROW_INT(4); break;
 		}
+		poll.branch = 0;
 	}
 	IME = IMA;
 
+	/* Run until the next event without looking at the timers. Just
+		after EI, or in HALT, only one instruction may run. */
+	if (IME && ((IF & IE) || cpu.halt))
+		cpu.horizon = 0;
+	else
+		cpu.horizon = cpu_horizon(i, IF_VBLANK | IF_STAT | (IE & IF_TIMER));
+
+dispatch:
+#ifdef GNUBOY_CPU_TRACE
 	if (debug_trace) debug_disassemble(PC, 1);
+#endif
 	op = FETCH;
 	clen = cycles_table[op];
 
+#ifdef CPU_THREADED
+	goto *optable[op];
+	do /* break leaves the handler, as in the switch */
+	{
+#else
 	switch(op)
 	{
-	case 0x00: /* NOP */
-	case 0x40: /* LD B,B */
-	case 0x49: /* LD C,C */
-	case 0x52: /* LD D,D */
-	case 0x5B: /* LD E,E */
-	case 0x64: /* LD H,H */
-	case 0x6D: /* LD L,L */
-	case 0x7F: /* LD A,A */
+#endif
+	OP(0x00): /* NOP */
+	OP(0x40): /* LD B,B */
+	OP(0x49): /* LD C,C */
+	OP(0x52): /* LD D,D */
+	OP(0x5B): /* LD E,E */
+	OP(0x64): /* LD H,H */
+	OP(0x6D): /* LD L,L */
+	OP(0x7F): /* LD A,A */
 		break;
 
-	case 0x41: /* LD B,C */
+	OP(0x41): /* LD B,C */
 		B = C; break;
-	case 0x42: /* LD B,D */
+	OP(0x42): /* LD B,D */
 		B = D; break;
-	case 0x43: /* LD B,E */
+	OP(0x43): /* LD B,E */
 		B = E; break;
-	case 0x44: /* LD B,H */
+	OP(0x44): /* LD B,H */
 		B = H; break;
-	case 0x45: /* LD B,L */
+	OP(0x45): /* LD B,L */
 		B = L; break;
-	case 0x46: /* LD B,(HL) */
+	OP(0x46): /* LD B,(HL) */
 		B = readb(xHL); break;
-	case 0x47: /* LD B,A */
+	OP(0x47): /* LD B,A */
 		B = A; break;
 
-	case 0x48: /* LD C,B */
+	OP(0x48): /* LD C,B */
 		C = B; break;
-	case 0x4A: /* LD C,D */
+	OP(0x4A): /* LD C,D */
 		C = D; break;
-	case 0x4B: /* LD C,E */
+	OP(0x4B): /* LD C,E */
 		C = E; break;
-	case 0x4C: /* LD C,H */
+	OP(0x4C): /* LD C,H */
 		C = H; break;
-	case 0x4D: /* LD C,L */
+	OP(0x4D): /* LD C,L */
 		C = L; break;
-	case 0x4E: /* LD C,(HL) */
+	OP(0x4E): /* LD C,(HL) */
 		C = readb(xHL); break;
-	case 0x4F: /* LD C,A */
+	OP(0x4F): /* LD C,A */
 		C = A; break;
 
-	case 0x50: /* LD D,B */
+	OP(0x50): /* LD D,B */
 		D = B; break;
-	case 0x51: /* LD D,C */
+	OP(0x51): /* LD D,C */
 		D = C; break;
-	case 0x53: /* LD D,E */
+	OP(0x53): /* LD D,E */
 		D = E; break;
-	case 0x54: /* LD D,H */
+	OP(0x54): /* LD D,H */
 		D = H; break;
-	case 0x55: /* LD D,L */
+	OP(0x55): /* LD D,L */
 		D = L; break;
-	case 0x56: /* LD D,(HL) */
+	OP(0x56): /* LD D,(HL) */
 		D = readb(xHL); break;
-	case 0x57: /* LD D,A */
+	OP(0x57): /* LD D,A */
 		D = A; break;
 
-	case 0x58: /* LD E,B */
+	OP(0x58): /* LD E,B */
 		E = B; break;
-	case 0x59: /* LD E,C */
+	OP(0x59): /* LD E,C */
 		E = C; break;
-	case 0x5A: /* LD E,D */
+	OP(0x5A): /* LD E,D */
 		E = D; break;
-	case 0x5C: /* LD E,H */
+	OP(0x5C): /* LD E,H */
 		E = H; break;
-	case 0x5D: /* LD E,L */
+	OP(0x5D): /* LD E,L */
 		E = L; break;
-	case 0x5E: /* LD E,(HL) */
+	OP(0x5E): /* LD E,(HL) */
 		E = readb(xHL); break;
-	case 0x5F: /* LD E,A */
+	OP(0x5F): /* LD E,A */
 		E = A; break;
 
-	case 0x60: /* LD H,B */
+	OP(0x60): /* LD H,B */
 		H = B; break;
-	case 0x61: /* LD H,C */
+	OP(0x61): /* LD H,C */
 		H = C; break;
-	case 0x62: /* LD H,D */
+	OP(0x62): /* LD H,D */
 		H = D; break;
-	case 0x63: /* LD H,E */
+	OP(0x63): /* LD H,E */
 		H = E; break;
-	case 0x65: /* LD H,L */
+	OP(0x65): /* LD H,L */
 		H = L; break;
-	case 0x66: /* LD H,(HL) */
+	OP(0x66): /* LD H,(HL) */
 		H = readb(xHL); break;
-	case 0x67: /* LD H,A */
+	OP(0x67): /* LD H,A */
 		H = A; break;
 
-	case 0x68: /* LD L,B */
+	OP(0x68): /* LD L,B */
 		L = B; break;
-	case 0x69: /* LD L,C */
+	OP(0x69): /* LD L,C */
 		L = C; break;
-	case 0x6A: /* LD L,D */
+	OP(0x6A): /* LD L,D */
 		L = D; break;
-	case 0x6B: /* LD L,E */
+	OP(0x6B): /* LD L,E */
 		L = E; break;
-	case 0x6C: /* LD L,H */
+	OP(0x6C): /* LD L,H */
 		L = H; break;
-	case 0x6E: /* LD L,(HL) */
+	OP(0x6E): /* LD L,(HL) */
 		L = readb(xHL); break;
-	case 0x6F: /* LD L,A */
+	OP(0x6F): /* LD L,A */
 		L = A; break;
 
-	case 0x70: /* LD (HL),B */
+	OP(0x70): /* LD (HL),B */
 		b = B; goto __LD_HL;
-	case 0x71: /* LD (HL),C */
+	OP(0x71): /* LD (HL),C */
 		b = C; goto __LD_HL;
-	case 0x72: /* LD (HL),D */
+	OP(0x72): /* LD (HL),D */
 		b = D; goto __LD_HL;
-	case 0x73: /* LD (HL),E */
+	OP(0x73): /* LD (HL),E */
 		b = E; goto __LD_HL;
-	case 0x74: /* LD (HL),H */
+	OP(0x74): /* LD (HL),H */
 		b = H; goto __LD_HL;
-	case 0x75: /* LD (HL),L */
+	OP(0x75): /* LD (HL),L */
 		b = L; goto __LD_HL;
-	case 0x77: /* LD (HL),A */
+	OP(0x77): /* LD (HL),A */
 		b = A;
 	__LD_HL:
 		writeb(xHL,b);
 		break;
 
-	case 0x78: /* LD A,B */
+	OP(0x78): /* LD A,B */
 		A = B; break;
-	case 0x79: /* LD A,C */
+	OP(0x79): /* LD A,C */
 		A = C; break;
-	case 0x7A: /* LD A,D */
+	OP(0x7A): /* LD A,D */
 		A = D; break;
-	case 0x7B: /* LD A,E */
+	OP(0x7B): /* LD A,E */
 		A = E; break;
-	case 0x7C: /* LD A,H */
+	OP(0x7C): /* LD A,H */
 		A = H; break;
-	case 0x7D: /* LD A,L */
+	OP(0x7D): /* LD A,L */
 		A = L; break;
-	case 0x7E: /* LD A,(HL) */
+	OP(0x7E): /* LD A,(HL) */
 		A = readb(xHL); break;
 
-	case 0x01: /* LD BC,imm */
+	OP(0x01): /* LD BC,imm */
 		BC = readw(xPC); PC += 2; break;
-	case 0x11: /* LD DE,imm */
+	OP(0x11): /* LD DE,imm */
 		DE = readw(xPC); PC += 2; break;
-	case 0x21: /* LD HL,imm */
+	OP(0x21): /* LD HL,imm */
 		HL = readw(xPC); PC += 2; break;
-	case 0x31: /* LD SP,imm */
+	OP(0x31): /* LD SP,imm */
 		SP = readw(xPC); PC += 2; break;
 
-	case 0x02: /* LD (BC),A */
+	OP(0x02): /* LD (BC),A */
 		writeb(xBC, A); break;
-	case 0x0A: /* LD A,(BC) */
+	OP(0x0A): /* LD A,(BC) */
 		A = readb(xBC); break;
-	case 0x12: /* LD (DE),A */
+	OP(0x12): /* LD (DE),A */
 		writeb(xDE, A); break;
-	case 0x1A: /* LD A,(DE) */
+	OP(0x1A): /* LD A,(DE) */
 		A = readb(xDE); break;
 
-	case 0x22: /* LDI (HL),A */
+	OP(0x22): /* LDI (HL),A */
 		writeb(xHL, A); HL++; break;
-	case 0x2A: /* LDI A,(HL) */
+	OP(0x2A): /* LDI A,(HL) */
 		A = readb(xHL); HL++; break;
-	case 0x32: /* LDD (HL),A */
+	OP(0x32): /* LDD (HL),A */
 		writeb(xHL, A); HL--; break;
-	case 0x3A: /* LDD A,(HL) */
+	OP(0x3A): /* LDD A,(HL) */
 		A = readb(xHL); HL--; break;
 
-	case 0x06: /* LD B,imm */
+	OP(0x06): /* LD B,imm */
 		B = FETCH; break;
-	case 0x0E: /* LD C,imm */
+	OP(0x0E): /* LD C,imm */
 		C = FETCH; break;
-	case 0x16: /* LD D,imm */
+	OP(0x16): /* LD D,imm */
 		D = FETCH; break;
-	case 0x1E: /* LD E,imm */
+	OP(0x1E): /* LD E,imm */
 		E = FETCH; break;
-	case 0x26: /* LD H,imm */
+	OP(0x26): /* LD H,imm */
 		H = FETCH; break;
-	case 0x2E: /* LD L,imm */
+	OP(0x2E): /* LD L,imm */
 		L = FETCH; break;
-	case 0x36: /* LD (HL),imm */
+	OP(0x36): /* LD (HL),imm */
 		b = FETCH; writeb(xHL, b); break;
-	case 0x3E: /* LD A,imm */
+	OP(0x3E): /* LD A,imm */
 		A = FETCH; break;
 
-	case 0x08: /* LD (imm),SP */
+	OP(0x08): /* LD (imm),SP */
 		writew(readw(xPC), SP); PC += 2; break;
-	case 0xEA: /* LD (imm),A */
+	OP(0xEA): /* LD (imm),A */
 		writeb(readw(xPC), A); PC += 2; break;
 
-	case 0xE0: /* LDH (imm),A */
+	OP(0xE0): /* LDH (imm),A */
 		writehi(FETCH, A); break;
-	case 0xE2: /* LDH (C),A */
+	OP(0xE2): /* LDH (C),A */
 		writehi(C, A); break;
-	case 0xF0: /* LDH A,(imm) */
+	OP(0xF0): /* LDH A,(imm) */
 		A = readhi(FETCH); break;
-	case 0xF2: /* LDH A,(C) (undocumented) */
+	OP(0xF2): /* LDH A,(C) (undocumented) */
 		A = readhi(C); break;
 
 
-	case 0xF8: /* LD HL,SP+imm */
+	OP(0xF8): /* LD HL,SP+imm */
 #if 0
 		b = FETCH; LDHLSP(b); break;
 #else
@@ -660,100 +941,100 @@ next:
 		}
 		break;
 #endif
-	case 0xF9: /* LD SP,HL */
+	OP(0xF9): /* LD SP,HL */
 		SP = HL; break;
-	case 0xFA: /* LD A,(imm) */
+	OP(0xFA): /* LD A,(imm) */
 		A = readb(readw(xPC)); PC += 2; break;
 
-		ALU_CASES(0x80, 0xC6, ADD, __ADD)
-		ALU_CASES(0x88, 0xCE, ADC, __ADC)
-		ALU_CASES(0x90, 0xD6, SUB, __SUB)
-		ALU_CASES(0x98, 0xDE, SBC, __SBC)
-		ALU_CASES(0xA0, 0xE6, AND, __AND)
-		ALU_CASES(0xA8, 0xEE, XOR, __XOR)
-		ALU_CASES(0xB0, 0xF6, OR, __OR)
-		ALU_CASES(0xB8, 0xFE, CP, __CP)
+		ALU_CASES(0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0xC6, ADD, __ADD)
+		ALU_CASES(0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F, 0xCE, ADC, __ADC)
+		ALU_CASES(0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0xD6, SUB, __SUB)
+		ALU_CASES(0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x9D, 0x9E, 0x9F, 0xDE, SBC, __SBC)
+		ALU_CASES(0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xE6, AND, __AND)
+		ALU_CASES(0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF, 0xEE, XOR, __XOR)
+		ALU_CASES(0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xF6, OR, __OR)
+		ALU_CASES(0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF, 0xFE, CP, __CP)
 
-	case 0x09: /* ADD HL,BC */
+	OP(0x09): /* ADD HL,BC */
 		w = BC; goto __ADDW;
-	case 0x19: /* ADD HL,DE */
+	OP(0x19): /* ADD HL,DE */
 		w = DE; goto __ADDW;
-	case 0x39: /* ADD HL,SP */
+	OP(0x39): /* ADD HL,SP */
 		w = SP; goto __ADDW;
-	case 0x29: /* ADD HL,HL */
+	OP(0x29): /* ADD HL,HL */
 		w = HL;
 	__ADDW:
 		ADDW(w);
 		break;
 
-	case 0x04: /* INC B */
+	OP(0x04): /* INC B */
 		INC(B); break;
-	case 0x0C: /* INC C */
+	OP(0x0C): /* INC C */
 		INC(C); break;
-	case 0x14: /* INC D */
+	OP(0x14): /* INC D */
 		INC(D); break;
-	case 0x1C: /* INC E */
+	OP(0x1C): /* INC E */
 		INC(E); break;
-	case 0x24: /* INC H */
+	OP(0x24): /* INC H */
 		INC(H); break;
-	case 0x2C: /* INC L */
+	OP(0x2C): /* INC L */
 		INC(L); break;
-	case 0x34: /* INC (HL) */
+	OP(0x34): /* INC (HL) */
 		b = readb(xHL);
 		INC(b);
 		writeb(xHL, b);
 		break;
-	case 0x3C: /* INC A */
+	OP(0x3C): /* INC A */
 		INC(A); break;
 
-	case 0x03: /* INC BC */
+	OP(0x03): /* INC BC */
 		INCW(BC); break;
-	case 0x13: /* INC DE */
+	OP(0x13): /* INC DE */
 		INCW(DE); break;
-	case 0x23: /* INC HL */
+	OP(0x23): /* INC HL */
 		INCW(HL); break;
-	case 0x33: /* INC SP */
+	OP(0x33): /* INC SP */
 		INCW(SP); break;
 
-	case 0x05: /* DEC B */
+	OP(0x05): /* DEC B */
 		DEC(B); break;
-	case 0x0D: /* DEC C */
+	OP(0x0D): /* DEC C */
 		DEC(C); break;
-	case 0x15: /* DEC D */
+	OP(0x15): /* DEC D */
 		DEC(D); break;
-	case 0x1D: /* DEC E */
+	OP(0x1D): /* DEC E */
 		DEC(E); break;
-	case 0x25: /* DEC H */
+	OP(0x25): /* DEC H */
 		DEC(H); break;
-	case 0x2D: /* DEC L */
+	OP(0x2D): /* DEC L */
 		DEC(L); break;
-	case 0x35: /* DEC (HL) */
+	OP(0x35): /* DEC (HL) */
 		b = readb(xHL);
 		DEC(b);
 		writeb(xHL, b);
 		break;
-	case 0x3D: /* DEC A */
+	OP(0x3D): /* DEC A */
 		DEC(A); break;
 
-	case 0x0B: /* DEC BC */
+	OP(0x0B): /* DEC BC */
 		DECW(BC); break;
-	case 0x1B: /* DEC DE */
+	OP(0x1B): /* DEC DE */
 		DECW(DE); break;
-	case 0x2B: /* DEC HL */
+	OP(0x2B): /* DEC HL */
 		DECW(HL); break;
-	case 0x3B: /* DEC SP */
+	OP(0x3B): /* DEC SP */
 		DECW(SP); break;
 
-	case 0x07: /* RLCA */
+	OP(0x07): /* RLCA */
 		RLCA(A); break;
-	case 0x0F: /* RRCA */
+	OP(0x0F): /* RRCA */
 		RRCA(A); break;
-	case 0x17: /* RLA */
+	OP(0x17): /* RLA */
 		RLA(A); break;
-	case 0x1F: /* RRA */
+	OP(0x1F): /* RRA */
 		RRA(A); break;
 
-	case 0x27: /* DAA */
+	OP(0x27): /* DAA */
 #if 0
 		DAA
 #else
@@ -786,98 +1067,105 @@ next:
 		}
 #endif
 		break;
-	case 0x2F: /* CPL */
+	OP(0x2F): /* CPL */
 		CPL(A); break;
 
-	case 0x18: /* JR */
+	OP(0x18): /* JR */
 	__JR:
+		if (cpu_pollskip && (n8)readb(PC) < 0)
+		{
+			w = PC - 1;
+			JR;
+			i -= cpu_poll(w, op, cycles - i, i);
+			break;
+		}
 		JR; break;
-	case 0x20: /* JR NZ */
+	OP(0x20): /* JR NZ */
 		if (!(F&FZ)) goto __JR; NOJR; break;
-	case 0x28: /* JR Z */
+	OP(0x28): /* JR Z */
 		if (F&FZ) goto __JR; NOJR; break;
-	case 0x30: /* JR NC */
+	OP(0x30): /* JR NC */
 		if (!(F&FC)) goto __JR; NOJR; break;
-	case 0x38: /* JR C */
+	OP(0x38): /* JR C */
 		if (F&FC) goto __JR; NOJR; break;
 
-	case 0xC3: /* JP */
+	OP(0xC3): /* JP */
 	__JP:
 		JP; break;
-	case 0xC2: /* JP NZ */
+	OP(0xC2): /* JP NZ */
 		if (!(F&FZ)) goto __JP; NOJP; break;
-	case 0xCA: /* JP Z */
+	OP(0xCA): /* JP Z */
 		if (F&FZ) goto __JP; NOJP; break;
-	case 0xD2: /* JP NC */
+	OP(0xD2): /* JP NC */
 		if (!(F&FC)) goto __JP; NOJP; break;
-	case 0xDA: /* JP C */
+	OP(0xDA): /* JP C */
 		if (F&FC) goto __JP; NOJP; break;
-	case 0xE9: /* JP HL */
+	OP(0xE9): /* JP HL */
 		PC = HL; break;
 
-	case 0xC9: /* RET */
+	OP(0xC9): /* RET */
 	__RET:
 		RET; break;
-	case 0xC0: /* RET NZ */
+	OP(0xC0): /* RET NZ */
 		if (!(F&FZ)) goto __RET; NORET; break;
-	case 0xC8: /* RET Z */
+	OP(0xC8): /* RET Z */
 		if (F&FZ) goto __RET; NORET; break;
-	case 0xD0: /* RET NC */
+	OP(0xD0): /* RET NC */
 		if (!(F&FC)) goto __RET; NORET; break;
-	case 0xD8: /* RET C */
+	OP(0xD8): /* RET C */
 		if (F&FC) goto __RET; NORET; break;
-	case 0xD9: /* RETI */
-		IME = IMA = 1; goto __RET;
+	OP(0xD9): /* RETI */
+		IME = IMA = 1; RESCHEDULE; goto __RET;
 
-	case 0xCD: /* CALL */
+	OP(0xCD): /* CALL */
 	__CALL:
 		CALL; break;
-	case 0xC4: /* CALL NZ */
+	OP(0xC4): /* CALL NZ */
 		if (!(F&FZ)) goto __CALL; NOCALL; break;
-	case 0xCC: /* CALL Z */
+	OP(0xCC): /* CALL Z */
 		if (F&FZ) goto __CALL; NOCALL; break;
-	case 0xD4: /* CALL NC */
+	OP(0xD4): /* CALL NC */
 		if (!(F&FC)) goto __CALL; NOCALL; break;
-	case 0xDC: /* CALL C */
+	OP(0xDC): /* CALL C */
 		if (F&FC) goto __CALL; NOCALL; break;
 
-	case 0xC7: /* RST 0 */
+	OP(0xC7): /* RST 0 */
 		b = 0x00; goto __RST;
-	case 0xCF: /* RST 8 */
+	OP(0xCF): /* RST 8 */
 		b = 0x08; goto __RST;
-	case 0xD7: /* RST 10 */
+	OP(0xD7): /* RST 10 */
 		b = 0x10; goto __RST;
-	case 0xDF: /* RST 18 */
+	OP(0xDF): /* RST 18 */
 		b = 0x18; goto __RST;
-	case 0xE7: /* RST 20 */
+	OP(0xE7): /* RST 20 */
 		b = 0x20; goto __RST;
-	case 0xEF: /* RST 28 */
+	OP(0xEF): /* RST 28 */
 		b = 0x28; goto __RST;
-	case 0xF7: /* RST 30 */
+	OP(0xF7): /* RST 30 */
 		b = 0x30; goto __RST;
-	case 0xFF: /* RST 38 */
+	OP(0xFF): /* RST 38 */
 		b = 0x38;
 	__RST:
 		RST(b); break;
 
-	case 0xC1: /* POP BC */
+	OP(0xC1): /* POP BC */
 		POP(BC); break;
-	case 0xC5: /* PUSH BC */
+	OP(0xC5): /* PUSH BC */
 		PUSH(BC); break;
-	case 0xD1: /* POP DE */
+	OP(0xD1): /* POP DE */
 		POP(DE); break;
-	case 0xD5: /* PUSH DE */
+	OP(0xD5): /* PUSH DE */
 		PUSH(DE); break;
-	case 0xE1: /* POP HL */
+	OP(0xE1): /* POP HL */
 		POP(HL); break;
-	case 0xE5: /* PUSH HL */
+	OP(0xE5): /* PUSH HL */
 		PUSH(HL); break;
-	case 0xF1: /* POP AF */
+	OP(0xF1): /* POP AF */
 		POP(AF); AF &= 0xfff0; break;
-	case 0xF5: /* PUSH AF */
+	OP(0xF5): /* PUSH AF */
 		PUSH(AF); break;
 
-	case 0xE8: /* ADD SP,imm */
+	OP(0xE8): /* ADD SP,imm */
 #if 0
 		b = FETCH; ADDSP(b); break;
 #else
@@ -898,20 +1186,23 @@ next:
 		break;
 #endif
 
-	case 0xF3: /* DI */
+	OP(0xF3): /* DI */
 		DI; break;
-	case 0xFB: /* EI */
+	OP(0xFB): /* EI */
 		EI; break;
 
-	case 0x37: /* SCF */
+	OP(0x37): /* SCF */
 		SCF; break;
-	case 0x3F: /* CCF */
+	OP(0x3F): /* CCF */
 		CCF; break;
 
-	case 0x10: /* STOP */
+	OP(0x10): /* STOP */
 		PC++;
 		if (R_KEY1 & 1)
 		{
+			/* Time so far runs at the old speed */
+			cpu_sync();
+			RESCHEDULE;
 			cpu.speed = cpu.speed ^ 1;
 			R_KEY1 = (R_KEY1 & 0x7E) | (cpu.speed << 7);
 			break;
@@ -919,11 +1210,12 @@ next:
 		/* NOTE - we do not implement dmg STOP whatsoever */
 		break;
 
-	case 0x76: /* HALT */
+	OP(0x76): /* HALT */
 		cpu.halt = 1;
+		RESCHEDULE;
 		break;
 
-	case 0xCB: /* CB prefix */
+	OP(0xCB): /* CB prefix */
 		cbop = FETCH;
 		clen = cb_cycles_table[cbop];
 		switch (cbop)
@@ -947,24 +1239,28 @@ next:
 		}
 		break;
 
-	default:
+	OP_INVALID:
 		die(
 			"invalid opcode 0x%02X at address 0x%04X, rombank = %d\n",
 			op, (PC-1) & 0xffff, mbc.rombank);
 		break;
+#ifdef CPU_THREADED
+	} while (0);
+#else
 	}
+#endif
 
-	/* Advance time counters */
-	/* FIXME: make use of cpu_timers() */
+	/* Time counters catch up at the next event or I/O access */
 	clen <<= 1;
-	div_advance(clen);
-	timer_advance(clen);
 	clen >>= cpu.speed;
-	lcdc_advance(clen);
-	sound_advance(clen);
+	cpu.pending += clen;
 
 	i -= clen;
+	if (cpu.pending < cpu.horizon) goto dispatch;
+
 	if (i > 0) goto next;
+
+	cpu_sync();
 	return cycles-i;
 }
 
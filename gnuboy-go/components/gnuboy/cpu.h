@@ -22,14 +22,25 @@ struct cpu
 	int div, tim;
 	int lcdc;
 	int snd;
+	int pending; /* time run but not yet given to the timers */
+	int horizon; /* time until the next event, from the last sync */
+};
+
+struct cpu_stats
+{
+	int loops;      /* polling loops skipped ahead */
+	int skipped;    /* time skipped, in 2MHz units */
 };
 
 extern struct cpu cpu;
+extern int cpu_pollskip; /* skip polling loops up to the next event */
 
 
 void cpu_timers(int cnt);
+void cpu_sync();
 void cpu_reset();
 int cpu_emulate(int cycles); /* NOTE there may be an ASM version of that */
+void cpu_stats_get(struct cpu_stats *out);
 
 void div_advance(int cnt);
 void timer_advance(int cnt);
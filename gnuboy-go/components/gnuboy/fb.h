@@ -15,6 +15,7 @@ struct fb
 	int pelsize;
 	int pitch;
 	int indexed;
+	int byteswap; /* 16bpp pixels are big endian */
 	struct
 	{
 		int l, r;
@@ -55,6 +55,8 @@ void IRAM_ATTR hw_dma(byte b)
 	a = ((addr)b) << 8;
 	for (i = 0; i < 160; i++, a++)
 		lcd.oam.mem[i] = readb(a);
+
+	oam_dirty();
 }
 
 
@@ -18,6 +18,8 @@
 #include <esp_attr.h>
 #include <stdint.h>
 
+#include "../odroid/odroid_framemailbox.h"
+
 struct lcd lcd;
 
 struct scan scan;
@@ -72,68 +74,59 @@ static byte *vdest;
 //#define MEMCPY8(d, s) memcpy((d), (s), 8)
 //#endif
 
-static byte pix[8];
+// Decoded tiles, one byte per pixel, for the 384 tiles of each VRAM bank.
+// Each row is two words holding 4 pixels each in screen order.
+// Flips are applied on read.
+#define PATCACHE_TILES (384 * 2)
 
-__attribute__((optimize("unroll-loops")))
-static const byte* IRAM_ATTR get_patpix(int i, int x)
-{
-	const int index = i & 0x3ff; // 1024 entries
-	const int rotation = i >> 10; // / 1024;
+static un32 patcache[PATCACHE_TILES][8][2];
 
-	int j;
-	int a, c;
-	const byte* const vram = lcd.vbank[0];
+// One bit per tile row, set when VRAM changed since the row was decoded
+static byte patdirty[PATCACHE_TILES];
 
-	switch (rotation)
-	{
-		case 0:
-			a = ((index << 4) | (x << 1));
+// Bumped on every change to a tile, for the line signatures. 32 bits so
+// that a count does not come back around while a line still holds it.
+static un32 patgen[PATCACHE_TILES];
 
-			for (byte k = 0; k < 8; k++)
-			{
-				c = vram[a] & (1 << k) ? 1 : 0;
-				c |= vram[a+1] & (1 << k) ? 2 : 0;
-				pix[7 - k] = c;
-			}
-			break;
+// 4 bits, most significant first, spread to one byte each
+static un32 patexpand[16];
 
-		case 1:
-			a = ((index << 4) | (x << 1));
+static un32 pix[2];
 
-			for (byte k = 0; k < 8; k++)
-			{
-				c = vram[a] & (1 << k) ? 1 : 0;
-				c |= vram[a+1] & (1 << k) ? 2 : 0;
-				pix[k] = c;
-			}
-			break;
+static inline int patcache_tile(int index)
+{
+	// Bank 1 tiles start at index 512
+	return (index & 0x1ff) + ((index & 0x200) ? 384 : 0);
+}
 
-		case 2:
-			j = 7 - x;
-			a = ((index << 4) | (j << 1));
+static const byte* IRAM_ATTR get_patpix(int i, int x)
+{
+	const int rotation = i >> 10; // / 1024;
+	const int tile = patcache_tile(i & 0x3ff);
+	const int row = (rotation & 2) ? 7 - x : x;
 
-			for (byte k = 0; k < 8; k++)
-			{
-				c = vram[a] & (1 << k) ? 1 : 0;
-				c |= vram[a+1] & (1 << k) ? 2 : 0;
-				pix[7 - k] = c;
-			}
-			break;
+	un32* const src = patcache[tile][row];
 
-		case 3:
-			j = 7 - x;
-			a = ((index << 4) | (j << 1));
+	if (patdirty[tile] & (1 << row))
+	{
+		const byte* const vram = lcd.vbank[0] + (((i & 0x3ff) << 4) | (row << 1));
+		const byte lo = vram[0];
+		const byte hi = vram[1];
 
-			for (byte k = 0; k < 8; k++)
-			{
-				c = vram[a] & (1 << k) ? 1 : 0;
-				c |= vram[a+1] & (1 << k) ? 2 : 0;
-				pix[k] = c;
-			}
-			break;
+		src[0] = patexpand[lo >> 4] | (patexpand[hi >> 4] << 1);
+		src[1] = patexpand[lo & 15] | (patexpand[hi & 15] << 1);
+
+		patdirty[tile] &= ~(1 << row);
 	}
 
-	return pix;
+	if (!(rotation & 1))
+		return (const byte*)src;
+
+	// Horizontal flip reverses the 8 bytes
+	pix[0] = __builtin_bswap32(src[1]);
+	pix[1] = __builtin_bswap32(src[0]);
+
+	return (const byte*)pix;
 }
 
 
@@ -484,26 +477,83 @@ static void IRAM_ATTR spr_count()
 }
 
 
-static struct vissprite ts[10];
+// OAM entries on each visible line, at most 10, in drawing priority order.
+// Rebuilt when OAM or the sprite size changes instead of walking OAM on
+// every line.
+static byte sprbins[144][10];
+static byte sprbincount[144];
+static int sprbinsize = -1; // R_LCDC sprite size bit the bins were built for
+static int sprbindirty = 1;
+
+void oam_dirty()
+{
+	sprbindirty = 1;
+}
+
+static void IRAM_ATTR spr_bin()
+{
+	int i, j, l;
+	struct obj *o;
+	int first, last;
+	byte *bin;
+
+	sprbinsize = R_LCDC & 0x04;
+	sprbindirty = 0;
+
+	memset(sprbincount, 0, sizeof sprbincount);
+
+	o = lcd.oam.obj;
+
+	for (i = 0; i < 40; i++, o++)
+	{
+		first = (int)o->y - 16;
+		last = (int)o->y - (sprbinsize ? 1 : 9);
+		if (first < 0) first = 0;
+		if (last > 143) last = 143;
+
+		for (l = first; l <= last; l++)
+		{
+			if (sprbincount[l] == 10)
+				continue;
+
+			bin = sprbins[l];
+			j = sprbincount[l]++;
+
+			/* DMG sprites on the left win, OAM order breaks ties */
+			if (sprsort && !hw.cgb)
+			{
+				while (j > 0 && lcd.oam.obj[bin[j - 1]].x > o->x)
+				{
+					bin[j] = bin[j - 1];
+					j--;
+				}
+			}
+
+			bin[j] = i;
+		}
+	}
+}
 
 static void IRAM_ATTR spr_enum()
 {
-	int i, j;
+	int i;
 	struct obj *o;
 	int v, pat;
-	int l, x;
+	byte *bin;
 
 	NS = 0;
 	if (!(R_LCDC & 0x02)) return;
+	if (L > 143) return;
 
-	o = lcd.oam.obj;
+	if (sprbindirty || (R_LCDC & 0x04) != sprbinsize)
+		spr_bin();
 
-	for (i = 40; i; i--, o++)
+	bin = sprbins[L];
+
+	for (i = sprbincount[L]; i; i--, bin++)
 	{
-		if (L >= o->y || L + 16 < o->y)
-			continue;
-		if (L + 8 >= o->y && !(R_LCDC & 0x04))
-			continue;
+		o = &lcd.oam.obj[*bin];
+
 		VS[NS].x = (int)o->x - 8;
 		v = L - (int)o->y + 16;
 		if (hw.cgb)
@@ -531,38 +581,8 @@ static void IRAM_ATTR spr_enum()
 		VS[NS].pat = pat;
 		VS[NS].v = v;
 
-		if (++NS == 10) break;
+		NS++;
 	}
-	if (!sprsort || hw.cgb) return;
-	/* not quite optimal but it finally works! */
-	for (i = 0; i < NS; i++)
-	{
-		l = 0;
-		x = VS[0].x;
-		for (j = 1; j < NS; j++)
-		{
-			if (VS[j].x < x)
-			{
-				l = j;
-				x = VS[j].x;
-			}
-		}
-		ts[i] = VS[l];
-		VS[l].x = 160;
-	}
-
-#if 1
-	memcpy(VS, ts, sizeof VS);
-#else
-	int* vsPtr = (int*)VS;
-	int* tsPtr = (int*)ts;
-	int count = 16;
-	while(count--)
-	{
-		vsPtr[0] = tsPtr[0];
-		vsPtr++[1] = tsPtr++[1];
-	}
-#endif
 }
 
 
@@ -635,23 +655,124 @@ static void IRAM_ATTR spr_scan()
 }
 
 
+extern uint16_t* displayBuffer[ODROID_FRAMEMAILBOX_SLOTS];
+int lastLcdDisabled = 0;
+
+// Signature of the inputs each line of each display buffer was rendered
+// from, hash 0 if unknown. A line whose inputs did not change since it was
+// rendered into any buffer is reused instead of rendered again.
+//
+// Registers and the palette generation are kept exactly. Tile data and
+// sprites only go into the 31 bit FNV-1a hash, so two different lines are
+// taken as equal with a chance of about 1 in 2^31 when the exact part
+// matches.
+struct linesig
+{
+	un32 hash;
+	un32 scroll; // SCX, line in the BG map, WX, line in the window
+	un32 state;  // palette generation << 8 | LCDC
+};
+
+static struct linesig linesig[ODROID_FRAMEMAILBOX_SLOTS][144];
+static int linebuffer = -1; // display buffer of the frame, -1 if none
+static un32 palgen;
+
+static struct lcd_stats stats;
+
 inline void lcd_begin()
 {
 	vdest = fb.ptr;
 	WY = R_WY;
+
+	linebuffer = -1;
+	for (int i = 0; i < ODROID_FRAMEMAILBOX_SLOTS; i++)
+	{
+		if (fb.ptr == (byte*)displayBuffer[i])
+			linebuffer = i;
+	}
 }
 
+static inline un32 linesig_mix(un32 h, un32 v)
+{
+	return (h ^ v) * 0x01000193;
+}
 
-extern int frame;
-extern uint16_t* displayBuffer[2];
-int lastLcdDisabled = 0;
+static un32 IRAM_ATTR linesig_tiles(un32 h, const int *tile, int cnt)
+{
+	for (; cnt > 0; cnt--)
+	{
+		h = linesig_mix(h, *tile);
+		h = linesig_mix(h, patgen[patcache_tile(*tile & 0x3ff)]);
+		tile++;
 
-void IRAM_ATTR lcd_refreshline()
+		/* cgb palette */
+		if (hw.cgb) h = linesig_mix(h, *(tile++));
+	}
+
+	return h;
+}
+
+static un32 IRAM_ATTR linesig_attr(un32 h, int base)
 {
-	byte *dest;
+	const un32 *a = (const un32 *)(lcd.vbank[1] + base);
+
+	for (int i = 0; i < 8; i++)
+		h = linesig_mix(h, a[i] & 0x80808080);
+
+	return h;
+}
+
+/* Everything the rendered line depends on, after spr_enum and tilebuf */
+static void IRAM_ATTR linesig_get(struct linesig *sig)
+{
+	un32 h = 0x811c9dc5;
+	int i;
+
+	sig->scroll = (X << 24) | (Y << 16) | ((WX & 0xff) << 8) | ((L - WY) & 0xff);
+	sig->state = (palgen << 8) | R_LCDC;
+
+	h = linesig_tiles(h, BG, WX > 0 ? ((WX + 7) >> 3) + 1 : 0);
+	if (WX < 160)
+		h = linesig_tiles(h, WND, ((160 - WX) >> 3) + 1);
+
+	for (i = 0; i < NS; i++)
+	{
+		h = linesig_mix(h, (VS[i].x << 16) | (un16)VS[i].pat);
+		h = linesig_mix(h, (VS[i].v << 16) | (VS[i].pal << 8) | VS[i].pri);
+		h = linesig_mix(h, patgen[patcache_tile(VS[i].pat & 0x3ff)]);
+	}
+
+	/* bg priority bits */
+	if (hw.cgb && NS)
+	{
+		h = linesig_attr(h, ((R_LCDC&0x08)?0x1C00:0x1800) + (T<<5));
+		if (WX < 160)
+			h = linesig_attr(h, ((R_LCDC&0x40)?0x1C00:0x1800) + (WT<<5));
+	}
+
+	/* 0 marks an unknown line */
+	sig->hash = h | 1;
+}
+
+static inline int linesig_equal(const struct linesig *a, const struct linesig *b)
+{
+	return a->hash == b->hash && a->scroll == b->scroll && a->state == b->state;
+}
 
-	if ((frame % 7) == 0) ++frame;
+static void linesig_reset()
+{
+	memset(linesig, 0, sizeof linesig);
+}
 
+void lcd_stats_get(struct lcd_stats *out)
+{
+	*out = stats;
+	memset(&stats, 0, sizeof stats);
+}
+
+void IRAM_ATTR lcd_refreshline()
+{
+	byte *dest;
 
 	L = R_LY;
 	X = R_SCX;
@@ -667,14 +788,18 @@ void IRAM_ATTR lcd_refreshline()
 	WT = (L - WY) >> 3;
 	WV = (L - WY) & 7;
 
-	if ((frame % 2) == 0)
+	/* frame pacing clears fb.enabled for dropped frames */
+	if (fb.enabled)
 	{
 		if (!(R_LCDC & 0x80))
 		{
 			if (!lastLcdDisabled)
 			{
-				memset(displayBuffer[0], 0xff, 144 * 160 * 2);
-				memset(displayBuffer[1], 0xff, 144 * 160 * 2);
+				/* frames keep being published while the LCD is off,
+					so every slot must show the blank screen */
+				for (int i = 0; i < ODROID_FRAMEMAILBOX_SLOTS; i++)
+					memset(displayBuffer[i], 0xff, 144 * 160 * 2);
+				linesig_reset();
 
 				lastLcdDisabled = 1;
 			}
@@ -688,6 +813,34 @@ void IRAM_ATTR lcd_refreshline()
 		spr_enum();
 		tilebuf();
 
+		++stats.lines;
+
+		struct linesig sig;
+		if (linebuffer >= 0 && L < 144)
+		{
+			linesig_get(&sig);
+
+			if (linesig_equal(&linesig[linebuffer][L], &sig))
+			{
+				++stats.skipped;
+				vdest += fb.pitch;
+				return;
+			}
+
+			for (int i = 0; i < ODROID_FRAMEMAILBOX_SLOTS; i++)
+			{
+				if (linesig_equal(&linesig[i][L], &sig))
+				{
+					memcpy(vdest, (byte*)displayBuffer[i] + L * fb.pitch, 160 * 2);
+					linesig[linebuffer][L] = sig;
+
+					++stats.copied;
+					vdest += fb.pitch;
+					return;
+				}
+			}
+		}
+
 		if (hw.cgb)
 		{
 			bg_scan_color();
@@ -713,6 +866,9 @@ void IRAM_ATTR lcd_refreshline()
 		byte* src = BUF;
 
 		while (cnt--) *(dst++) = PAL2[*(src++)];
+
+		if (linebuffer >= 0 && L < 144)
+			linesig[linebuffer][L] = sig;
 	}
 
 	vdest += fb.pitch;
@@ -737,7 +893,10 @@ inline static void updatepalette(int i)
 	// bit 10-14 blue
 	b = (c >> 10) & 0x1f;
 
-	PAL2[i] = (r << 11) | (g << (5 + 1)) | (b);
+	c = (r << 11) | (g << (5 + 1)) | (b);
+
+	PAL2[i] = fb.byteswap ? (un16)((c >> 8) | (c << 8)) : c;
+	++palgen;
 }
 
 inline void pal_write(int i, byte b)
@@ -776,15 +935,23 @@ void IRAM_ATTR pal_write_dmg(int i, int mapnum, byte d)
 
 inline void vram_write(int a, byte b)
 {
-	//if (lcd.vbank[R_VBK&1][a] != b)
+	const int bank = R_VBK & 1;
+
+	if (lcd.vbank[bank][a] != b)
 	{
-		lcd.vbank[R_VBK&1][a] = b;
+		lcd.vbank[bank][a] = b;
 		if (a >= 0x1800) return;
+
+		const int tile = (bank ? 384 : 0) + (a >> 4);
+		patdirty[tile] |= 1 << ((a >> 1) & 7);
+		++patgen[tile];
 	}
 }
 
 void vram_dirty()
 {
+	memset(patdirty, 0xff, sizeof patdirty);
+	linesig_reset();
 }
 
 void pal_dirty()
@@ -808,9 +975,17 @@ void pal_dirty()
 
 void lcd_reset()
 {
+	for (int i = 0; i < 16; i++)
+	{
+		byte* const dest = (byte*)&patexpand[i];
+		for (int k = 0; k < 4; k++)
+			dest[k] = (i >> (3 - k)) & 1;
+	}
+
 	memset(&lcd, 0, sizeof lcd);
 
 	lcd_begin();
 	vram_dirty();
 	pal_dirty();
+	oam_dirty();
 }
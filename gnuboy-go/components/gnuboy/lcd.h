@@ -43,6 +43,13 @@ struct lcd
 	byte pal[128];
 };
 
+struct lcd_stats
+{
+	int lines;      /* visible lines of presented frames */
+	int skipped;    /* lines already in the display buffer */
+	int copied;     /* lines copied from another display buffer */
+};
+
 extern struct lcd lcd;
 extern struct scan scan;
 
@@ -54,7 +61,9 @@ void pal_write_dmg(int i, int mapnum, byte d);
 void vram_write(int a, byte b);
 void pal_dirty();
 void vram_dirty();
+void oam_dirty();
 void lcd_reset();
+void lcd_stats_get(struct lcd_stats *out);
 //void bg_scan_color();
 void updatepatpix();
 
@@ -26,6 +26,7 @@
 #include "rtc.h"
 #include "rc.h"
 #include "sound.h"
+#include "loader.h"
 
 #include "../odroid/odroid_settings.h"
 #include "../odroid/odroid_sdcard.h"
@@ -34,7 +35,24 @@
 
 void* FlashAddress = 0;
 FILE* RomFile = NULL;
-uint8_t BankCache[512 / 8];
+
+// PSRAM kept for ROM banks read from the SD card. ROMs larger than this
+// run with the least recently used banks evicted.
+#ifndef ROM_POOL_SIZE
+#define ROM_POOL_SIZE (0x400000)
+#endif
+
+// Bank switching history, kept next to the save file so the next session
+// can prefetch the banks it is likely to need
+#define BANKPROFILE_MAGIC "GBBK"
+#define BANKPROFILE_VERSION 1
+#define BANKPROFILE_NONE 0xffff
+
+static uint16_t bankOrder[512];		// banks in order of first use
+static int bankOrderCount;
+static uint16_t bankNext[512];		// bank last switched to from each bank
+static uint8_t bankSeen[512];
+static int bankLast = -1;
 
 
 #ifndef GNUBOY_NO_MINIZIP
@@ -247,30 +265,13 @@ int rom_load()
 		}
 
 		// copy
-#if 0
-		const size_t BLOCK_SIZE = 512;
-		for (size_t offset = 0; offset < 0x4000; offset += BLOCK_SIZE)
-		{
-			size_t count = fread((uint8_t*)data + offset, 1, BLOCK_SIZE, RomFile);
-			__asm__("nop");
-			__asm__("nop");
-			__asm__("nop");
-			__asm__("nop");
-			__asm__("memw");
-
-			if (count < BLOCK_SIZE) break;
-		}
-#else
-		size_t count = fread((uint8_t*)data, 1, 0x4000, RomFile);
+		size_t count = odroid_sdcard_read(RomFile, 0, data, 0x4000);
 		if (count < 0x4000)
 		{
                         odroid_display_show_sderr(ODROID_SD_ERR_BADFILE);
-			printf("loader: fread failed.\n");
+			printf("loader: read failed.\n");
 			abort();
 		}
-#endif
-
-		BankCache[0] = 1;
 	}
 
 
@@ -344,6 +345,37 @@ int rom_load()
 	rom.bank[0] = data;
 	rom.length = rlen;
 
+	if (RomFile)
+	{
+		char* fileName = odroid_util_GetFileName(romPath);
+		if (!fileName) abort();
+
+		char* pathName = odroid_sdcard_create_savefile_path(SD_BASE_PATH, fileName);
+		if (!pathName) abort();
+
+		bankprofile_load(pathName);
+
+		free(pathName);
+		free(fileName);
+
+		size_t poolSize = (rlen < ROM_POOL_SIZE) ? rlen : ROM_POOL_SIZE;
+		odroid_sdcard_cache_start(RomFile, data, poolSize, 0x4000, mbc.romsize,
+			bankOrder, bankOrderCount,
+			odroid_display_lock_gb_display, odroid_display_unlock_gb_display);
+
+		// Bank 0 is mapped for the whole session, so it keeps the first pin
+		odroid_display_lock_gb_display();
+		rom.bank[0] = odroid_sdcard_cache_load(0, 0);
+		odroid_display_unlock_gb_display();
+
+		if (!rom.bank[0])
+		{
+			odroid_display_show_sderr(ODROID_SD_ERR_BADFILE);
+			printf("loader: read failed.\n");
+			abort();
+		}
+	}
+
 	// SRAM
 	ram.sram_dirty = 1;
 	ram.sbank = malloc(sram_length);
@@ -371,7 +403,8 @@ int rom_load()
 	mbc.rombank = 1;
 	mbc.rambank = 0;
 
-	tmp = *((int*)(header + 0x0140));
+	// The cache may have moved bank 0 out of the first slot
+	tmp = *((int*)(rom.bank[0] + 0x0140));
 	c = tmp >> 24;
 	hw.cgb = ((c == 0x80) || (c == 0xc0)) && !forcedmg;
 	hw.gba = (hw.cgb && gbamode);
@@ -415,6 +448,116 @@ int sram_load()
 }
 
 
+// The profile lives at the save path with a .bnk extension
+static char* bankprofile_path(char *path)
+{
+	size_t length = strlen(path);
+	char* result = malloc(length + 1);
+	if (!result) abort();
+
+	strcpy(result, path);
+
+	char* extension = strrchr(result, '.');
+	if (extension && strlen(extension) == 4)
+		strcpy(extension, ".bnk");
+	else
+		abort();
+
+	return result;
+}
+
+int bankprofile_load(char *path)
+{
+	memset(bankNext, 0xff, sizeof(bankNext));
+	memset(bankSeen, 0, sizeof(bankSeen));
+	bankOrderCount = 0;
+	bankLast = -1;
+
+	char* profilePath = bankprofile_path(path);
+	FILE* f = fopen(profilePath, "rb");
+	free(profilePath);
+
+	if (!f) return -1;
+
+	char magic[4];
+	uint16_t header[3];	// version, rom banks, order count
+
+	int ok = fread(magic, 4, 1, f) == 1 && memcmp(magic, BANKPROFILE_MAGIC, 4) == 0 &&
+		fread(header, sizeof(header), 1, f) == 1 &&
+		header[0] == BANKPROFILE_VERSION && header[1] == mbc.romsize && header[2] <= mbc.romsize &&
+		fread(bankOrder, sizeof(uint16_t), header[2], f) == header[2] &&
+		fread(bankNext, sizeof(uint16_t), mbc.romsize, f) == mbc.romsize;
+
+	fclose(f);
+
+	if (!ok)
+	{
+		printf("bankprofile_load: ignoring a profile for another ROM or version.\n");
+		memset(bankNext, 0xff, sizeof(bankNext));
+		return -1;
+	}
+
+	// Keep the order and add to it this session
+	for (int i = 0; i < header[2]; ++i)
+	{
+		if (bankOrder[i] < mbc.romsize && !bankSeen[bankOrder[i]])
+		{
+			bankSeen[bankOrder[i]] = 1;
+			bankOrder[bankOrderCount++] = bankOrder[i];
+		}
+	}
+
+	printf("bankprofile_load: %d banks.\n", bankOrderCount);
+	return bankOrderCount;
+}
+
+int bankprofile_save(char *path)
+{
+	if (!mbc.romsize) return -1;
+
+	char* profilePath = bankprofile_path(path);
+	FILE* f = fopen(profilePath, "wb");
+	free(profilePath);
+
+	if (!f)
+	{
+		printf("bankprofile_save: fopen failed.\n");
+		return -1;
+	}
+
+	const uint16_t header[3] = { BANKPROFILE_VERSION, mbc.romsize, bankOrderCount };
+
+	fwrite(BANKPROFILE_MAGIC, 4, 1, f);
+	fwrite(header, sizeof(header), 1, f);
+	fwrite(bankOrder, sizeof(uint16_t), bankOrderCount, f);
+	fwrite(bankNext, sizeof(uint16_t), mbc.romsize, f);
+	fclose(f);
+
+	printf("bankprofile_save: %d banks.\n", bankOrderCount);
+	return 0;
+}
+
+// Notes that bank was mapped in and returns the bank that followed it last
+// time, or -1
+int bankprofile_record(int bank)
+{
+	if (bank != bankLast)
+	{
+		if (bankLast >= 0)
+			bankNext[bankLast] = bank;
+
+		if (!bankSeen[bank])
+		{
+			bankSeen[bank] = 1;
+			bankOrder[bankOrderCount++] = bank;
+		}
+
+		bankLast = bank;
+	}
+
+	return (bankNext[bank] != BANKPROFILE_NONE) ? bankNext[bank] : -1;
+}
+
 int sram_save()
 {
 	/* If we crash before we ever loaded sram, DO NOT SAVE! */
@@ -490,6 +633,7 @@ void state_load(int n)
 		fclose(f);
 		vram_dirty();
 		pal_dirty();
+		oam_dirty();
 		sound_dirty();
 		mem_updatemap();
 	}
@@ -21,6 +21,9 @@ int sram_load();
 int sram_save();
 void state_load(int n);
 void state_save(int n);
+int bankprofile_load(char *path);
+int bankprofile_save(char *path);
+int bankprofile_record(int bank);
 
 
 
@@ -6,16 +6,19 @@
 #include "defs.h"
 #include "hw.h"
 #include "regs.h"
+#include "cpu.h"
 #include "mem.h"
 #include "rtc.h"
 #include "lcd.h"
 #include "sound.h"
+#include "loader.h"
 
 #include "esp_partition.h"
 #include "esp_attr.h"
 
 #include "../odroid/odroid_display.h"
 #include "../odroid/odroid_audio.h"
+#include "../odroid/odroid_sdcard.h"
 
 
 struct mbc mbc;
@@ -23,75 +26,43 @@ struct rom rom;
 struct ram ram;
 
 extern FILE* RomFile;
-extern uint8_t BankCache[512 / 8];
 
 static inline byte* GetRomPtr(short bank)
 {
 	// GBC pages are 16k.
 	const size_t BANK_SIZE = 0x4000;
 	byte* const PSRAM = (byte*)0x3f800000;
-	const size_t OFFSET = bank * BANK_SIZE;
 
 	if (RomFile)
 	{
-		short slot = bank >> 3;
-		uint8_t bit = 1 << (bank & 0x7);
-
-		if (!(BankCache[slot] & bit))
+		// The switchable bank takes the second pin, bank 0 holds the first
+		byte* result = odroid_sdcard_cache_get(bank, 1);
+		if (!result)
 		{
-			//printf("GetRomPtr: Loading bank=%d, slot=%d, bit=%d.\n", bank, slot, bit);
+			//printf("GetRomPtr: Loading bank=%d.\n", bank);
 
 			// Stop the SPI bus
 			odroid_display_lock_gb_display();
 
-			//odroid_display_drain_spi();
-
-			// Load the 16K page
-			if (fseek(RomFile, OFFSET, SEEK_SET))
-			{
-				printf("GetRomPtr: fseek failed. OFFSET=%d\n", OFFSET);
-
-				odroid_audio_terminate();
-
-				odroid_display_show_sderr(ODROID_SD_ERR_BADFILE);
-				abort();
-			}
-
-	#if 0
-			const size_t BLOCK_SIZE = 512;
-			for (size_t offset = 0; offset < BANK_SIZE; offset += BLOCK_SIZE)
-			{
-				size_t count = fread((uint8_t*)PSRAM + (bank * BANK_SIZE) + offset, 1, BLOCK_SIZE, RomFile);
-				__asm__("nop");
-				__asm__("nop");
-				__asm__("nop");
-				__asm__("nop");
-				__asm__("memw");
-
-				if (count < BLOCK_SIZE) break;
-			}
-	#else
-			size_t count = fread((uint8_t*)PSRAM + OFFSET, 1, BANK_SIZE, RomFile);
-			if (count < BANK_SIZE)
+			// Load the 16K page, unless the cache task just did
+			result = odroid_sdcard_cache_load(bank, 1);
+			if (!result)
 			{
-				printf("GetRomPtr: fread failed. bank=%d, count=%d\n", bank, count);
+				printf("GetRomPtr: read failed. bank=%d\n", bank);
 
 				odroid_audio_terminate();
 
 				odroid_display_show_sderr(ODROID_SD_ERR_BADFILE);
 				abort();
 			}
-	#endif
-
-			BankCache[slot] |= bit;
-
-			//printf("%s: bank=%d, result=%p\n", __func__, bank, (void*)PSRAM + OFFSET);
 
 			odroid_display_unlock_gb_display();
 		}
+
+		return result;
 	}
 
-	byte* result = PSRAM + OFFSET;
+	byte* result = PSRAM + bank * BANK_SIZE;
 	//printf("%s: bank=%d, result=%p\n", __func__, bank, result);
 
 	return result;
@@ -118,6 +89,14 @@ void IRAM_ATTR mem_updatemap()
 
 	rom.bank[mbc.rombank] = GetRomPtr(mbc.rombank);
 
+	if (RomFile)
+	{
+		// Ask for the bank that followed this one last time, and the next
+		// one since games tend to switch in order
+		odroid_sdcard_cache_hint(bankprofile_record(mbc.rombank));
+		odroid_sdcard_cache_hint(mbc.rombank + 1);
+	}
+
 	mbc.rambank &= (mbc.ramsize - 1);
 
 	map = mbc.rmap;
@@ -625,12 +604,17 @@ void IRAM_ATTR mem_write(int a, byte b)
 		if ((a & 0xFF00) == 0xFE00)
 		{
 			/* if (R_STAT & 0x02) break; */
-			if (a < 0xFEA0) lcd.oam.mem[a & 0xFF] = b;
+			if (a < 0xFEA0)
+			{
+				lcd.oam.mem[a & 0xFF] = b;
+				oam_dirty();
+			}
 			break;
 		}
 		/* return writehi(a & 0xFF, b); */
 		if (a >= 0xFF10 && a <= 0xFF3F)
 		{
+			cpu_sync();
 			sound_write(a & 0xFF, b);
 			break;
 		}
@@ -639,7 +623,10 @@ void IRAM_ATTR mem_write(int a, byte b)
 			ram.hi[a & 0xFF] = b;
 			break;
 		}
+		/* The write may move the next event or raise an interrupt */
+		cpu_sync();
 		ioreg_write(a & 0xFF, b);
+		cpu.horizon = 0;
 	}
 }
 
@@ -703,9 +690,13 @@ byte IRAM_ATTR mem_read(int a)
 		/* return readhi(a & 0xFF); */
 		if (a == 0xFFFF) return REG(0xFF);
 		if (a >= 0xFF10 && a <= 0xFF3F)
+		{
+			cpu_sync();
 			return sound_read(a & 0xFF);
+		}
 		if ((a & 0xFF80) == 0xFF80)
 			return ram.hi[a & 0xFF];
+		cpu_sync();
 		return ioreg_read(a & 0xFF);
 	}
 	return 0xff; /* not reached */
@@ -276,13 +276,11 @@ void IRAM_ATTR sound_mix()
 
 		if (pcm.buf)
 		{
+			/* Flush a full buffer instead of dropping samples */
 			if (pcm.pos >= pcm.len)
-			{
-				//pcm_submit();
-				printf("sound_mix: buffer overflow. (pcm.len=%d)\n", pcm.len);
-				//abort();
-			}
-			else if (pcm.stereo)
+				pcm_submit();
+
+			if (pcm.stereo)
 			{
 				pcm.buf[pcm.pos++] = (int16_t)l; //+128;
 				pcm.buf[pcm.pos++] = (int16_t)r; //+128;
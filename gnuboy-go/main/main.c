@@ -15,6 +15,7 @@
 #include "driver/rtc_io.h"
 #include "esp_partition.h"
 #include "esp_ota_ops.h"
+#include "rom/crc.h"
 
 #include "../components/gnuboy/loader.h"
 #include "../components/gnuboy/hw.h"
@@ -38,6 +39,8 @@
 #include "../components/odroid/odroid_audio.h"
 #include "../components/odroid/odroid_system.h"
 #include "../components/odroid/odroid_sdcard.h"
+#include "../components/odroid/odroid_framepace.h"
+#include "../components/odroid/odroid_framemailbox.h"
 
 
 extern int debug_trace;
@@ -46,19 +49,17 @@ struct fb fb;
 struct pcm pcm;
 
 
-uint16_t* displayBuffer[2]; //= { fb0, fb0 }; //[160 * 144];
-uint8_t currentBuffer;
+uint16_t* displayBuffer[ODROID_FRAMEMAILBOX_SLOTS]; //= { fb0, fb0 }; //[160 * 144];
+bool displayBufferByteSwapped[ODROID_FRAMEMAILBOX_SLOTS];
+odroid_framemailbox frameMailbox;
 
 uint16_t* framebuffer;
 int frame = 0;
 uint elapsedTime = 0;
 
-int32_t* audioBuffer[2];
-volatile uint8_t currentAudioBuffer = 0;
-volatile uint16_t currentAudioSampleCount;
-volatile int16_t* currentAudioBufferPtr;
 
 odroid_battery_state battery_state;
+odroid_framepace framePace;
 
 const char* StateFileName = "/storage/gnuboy.sav";
 
@@ -67,17 +68,20 @@ const char* StateFileName = "/storage/gnuboy.sav";
 
 #define AUDIO_SAMPLE_RATE (32000)
 
+// Busy-wait loops are only skipped for ROMs whose profile asks for it.
+// START+LEFT toggles it and stores the choice in the profile.
+#define IDLE_SKIP_DEFAULT (0)
+
 const char* SD_BASE_PATH = "/sd";
 
 // --- MAIN
-QueueHandle_t vidQueue;
-QueueHandle_t audioQueue;
 
 float Volume = 1.0f;
 
 int pcm_submit()
 {
-    odroid_audio_submit(currentAudioBufferPtr, currentAudioSampleCount >> 1);
+    odroid_audio_submit(pcm.buf, pcm.pos >> 1);
+    pcm.pos = 0;
 
     return 1;
 }
@@ -93,6 +97,9 @@ void run_to_vblank()
   /* FIXME: djudging by the time specified this was intended
   to emulate through vblank phase which is handled at the
   end of the loop. */
+  ODROID_FRAME_ACTION frameAction = odroid_framepace_frame_begin(&framePace);
+  fb.enabled = (frameAction == ODROID_FRAME_PRESENT);
+
   cpu_emulate(2280);
 
   /* FIXME: R_LY >= 0; comparsion to zero can also be removed
@@ -106,13 +113,12 @@ void run_to_vblank()
   /* VBLANK BEGIN */
 
   //vid_end();
-  if ((frame % 2) == 0)
+  if (frameAction == ODROID_FRAME_PRESENT)
   {
-      xQueueSend(vidQueue, &framebuffer, portMAX_DELAY);
+      displayBufferByteSwapped[odroid_framemailbox_back_get(&frameMailbox)] = fb.byteswap;
 
       // swap buffers
-      currentBuffer = currentBuffer ? 0 : 1;
-      framebuffer = displayBuffer[currentBuffer];
+      framebuffer = displayBuffer[odroid_framemailbox_publish(&frameMailbox)];
 
       fb.ptr = framebuffer;
   }
@@ -121,19 +127,7 @@ void run_to_vblank()
 
   sound_mix();
 
-  //if (pcm.pos > 100)
-  {
-        currentAudioBufferPtr = audioBuffer[currentAudioBuffer];
-        currentAudioSampleCount = pcm.pos;
-
-        void* tempPtr = 0x1234;
-        xQueueSend(audioQueue, &tempPtr, portMAX_DELAY);
-
-        // Swap buffers
-        currentAudioBuffer = currentAudioBuffer ? 0 : 1;
-        pcm.buf = audioBuffer[currentAudioBuffer];
-        pcm.pos = 0;
-  }
+  pcm_submit();
 
   if (!(R_LCDC & 0x80)) {
     /* LCDC operation stopped */
@@ -156,6 +150,19 @@ volatile bool videoTaskIsRunning = false;
 bool scaling_enabled = true;
 bool previous_scale_enabled = true;
 
+// Unscaled frames are sent as rendered, so have the palette produce big
+// endian pixels. The scaler expects native pixels.
+static void update_pixel_order()
+{
+    int byteswap = scaling_enabled ? 0 : 1;
+
+    if (fb.byteswap != byteswap)
+    {
+        fb.byteswap = byteswap;
+        pal_dirty();
+    }
+}
+
 void videoTask(void *arg)
 {
   esp_err_t ret;
@@ -165,22 +172,46 @@ void videoTask(void *arg)
   uint16_t* param;
   while(1)
   {
-        xQueuePeek(vidQueue, &param, portMAX_DELAY);
+        int slot = odroid_framemailbox_acquire(&frameMailbox);
 
-        if (param == 1)
+        if (slot < 0)
             break;
 
-        if (previous_scale_enabled != scaling_enabled)
+        param = displayBuffer[slot];
+
+        // Frames rendered before a scaling change keep their pixel order
+        bool direct = displayBufferByteSwapped[slot];
+        bool scale = direct ? false : scaling_enabled;
+
+        if (previous_scale_enabled != scale)
         {
             // Clear display
             ili9341_write_frame_gb(NULL, true);
-            previous_scale_enabled = scaling_enabled;
+            previous_scale_enabled = scale;
         }
 
-        ili9341_write_frame_gb(param, scaling_enabled);
-        odroid_input_battery_level_read(&battery_state);
+        odroid_framepace_present_begin(&framePace);
+
+        if (direct)
+        {
+            // Unscaled big endian frames are sent without a copy. The
+            // buffer is released to the emulator after the fence.
+            odroid_display_lock_gb_display();
+
+            odroid_display_direct_submit((320 / 2) - (GAMEBOY_WIDTH / 2), (240 / 2) - (GAMEBOY_HEIGHT / 2),
+                GAMEBOY_WIDTH, GAMEBOY_HEIGHT, param);
+            odroid_input_battery_level_read(&battery_state);
+            odroid_display_direct_fence();
+
+            odroid_display_unlock_gb_display();
+        }
+        else
+        {
+            ili9341_write_frame_gb(param, scale);
+            odroid_input_battery_level_read(&battery_state);
+        }
 
-        xQueueReceive(vidQueue, &param, portMAX_DELAY);
+        odroid_framepace_present_end(&framePace);
     }
 
 
@@ -199,44 +230,6 @@ void videoTask(void *arg)
 }
 
 
-volatile bool AudioTaskIsRunning = false;
-void audioTask(void* arg)
-{
-  // sound
-  uint16_t* param;
-
-  AudioTaskIsRunning = true;
-  while(1)
-  {
-    xQueuePeek(audioQueue, &param, portMAX_DELAY);
-
-    if (param == 0)
-    {
-        // TODO: determine if this is still needed
-        abort();
-    }
-    else if (param == 1)
-    {
-        break;
-    }
-    else
-    {
-        pcm_submit();
-    }
-
-    xQueueReceive(audioQueue, &param, portMAX_DELAY);
-  }
-
-  printf("audioTask: exiting.\n");
-  odroid_audio_terminate();
-
-  AudioTaskIsRunning = false;
-  vTaskDelete(NULL);
-
-  while (1) {}
-}
-
-
 static void SaveState()
 {
     // Save sram
@@ -252,17 +245,27 @@ static void SaveState()
         char* pathName = odroid_sdcard_create_savefile_path(SD_BASE_PATH, fileName);
         if (!pathName) abort();
 
-        FILE* f = fopen(pathName, "w");
-        if (f == NULL)
+        // Scripted runs always start from power on
+        if (odroid_input_script_mode_get() != ODROID_INPUT_SCRIPT_NONE)
         {
-            printf("%s: fopen save failed\n", __func__);
-            abort();
+            odroid_input_script_save();
         }
+        else
+        {
+            FILE* f = fopen(pathName, "w");
+            if (f == NULL)
+            {
+                printf("%s: fopen save failed\n", __func__);
+                abort();
+            }
 
-        savestate(f);
-        fclose(f);
+            savestate(f);
+            fclose(f);
 
-        printf("%s: savestate OK.\n", __func__);
+            printf("%s: savestate OK.\n", __func__);
+
+            bankprofile_save(pathName);
+        }
 
         free(pathName);
         free(fileName);
@@ -300,7 +303,10 @@ static void LoadState(const char* cartName)
         char* pathName = odroid_sdcard_create_savefile_path(SD_BASE_PATH, fileName);
         if (!pathName) abort();
 
-        FILE* f = fopen(pathName, "r");
+        FILE* f = NULL;
+        if (odroid_input_script_init(SD_BASE_PATH, romName) == ODROID_INPUT_SCRIPT_NONE)
+            f = fopen(pathName, "r");
+
         if (f == NULL)
         {
             printf("LoadState: fopen load failed\n");
@@ -312,6 +318,7 @@ static void LoadState(const char* cartName)
 
             vram_dirty();
             pal_dirty();
+            oam_dirty();
             sound_dirty();
             mem_updatemap();
 
@@ -336,6 +343,7 @@ static void LoadState(const char* cartName)
 
             vram_dirty();
             pal_dirty();
+            oam_dirty();
             sound_dirty();
             mem_updatemap();
 
@@ -349,21 +357,19 @@ static void LoadState(const char* cartName)
 
 static void PowerDown()
 {
-    uint16_t* param = 1;
-
     // Clear audio to prevent studdering
     printf("PowerDown: stopping audio.\n");
-
-    xQueueSend(audioQueue, &param, portMAX_DELAY);
-    while (AudioTaskIsRunning) {}
+    odroid_audio_terminate();
 
 
     // Stop tasks
     printf("PowerDown: stopping tasks.\n");
 
-    xQueueSend(vidQueue, &param, portMAX_DELAY);
+    odroid_framemailbox_close(&frameMailbox);
     while (videoTaskIsRunning) {}
 
+    odroid_sdcard_cache_stop();
+
 
     // state
     printf("PowerDown: Saving state.\n");
@@ -383,21 +389,19 @@ static void PowerDown()
 static void DoMenuHome()
 {
     esp_err_t err;
-    uint16_t* param = 1;
-
     // Clear audio to prevent studdering
     printf("PowerDown: stopping audio.\n");
-
-    xQueueSend(audioQueue, &param, portMAX_DELAY);
-    while (AudioTaskIsRunning) {}
+    odroid_audio_terminate();
 
 
     // Stop tasks
     printf("PowerDown: stopping tasks.\n");
 
-    xQueueSend(vidQueue, &param, portMAX_DELAY);
+    odroid_framemailbox_close(&frameMailbox);
     while (videoTaskIsRunning) {}
 
+    odroid_sdcard_cache_stop();
+
 
     // state
     printf("PowerDown: Saving state.\n");
@@ -420,6 +424,8 @@ void app_main(void)
 
     nvs_flash_init();
 
+    odroid_settings_init();
+
     odroid_system_init();
 
     odroid_input_gamepad_init();
@@ -477,6 +483,7 @@ void app_main(void)
     {
         forceConsoleReset = true;
         odroid_settings_StartAction_set(ODROID_START_ACTION_NORMAL);
+        odroid_settings_commit();
     }
 
 
@@ -488,27 +495,38 @@ void app_main(void)
     // Load ROM
     loader_init(NULL);
 
+    // Per-ROM settings. Only the first bank is sure to be loaded from the
+    // SD card at this point, and it holds the cartridge header. The header
+    // global checksum (0x14e) covers the whole ROM, so revisions differ in
+    // bank 0; a hack that leaves the checksum and bank 0 untouched shares
+    // the profile of its original.
+    odroid_settings_RomProfile_load(crc32_le(0, rom.bank[0], 0x4000));
+
+    odroid_rom_profile profile;
+    odroid_settings_RomProfile_get(&profile);
+
+    const int audioSampleRate = profile.audioSampleRate ? profile.audioSampleRate : AUDIO_SAMPLE_RATE;
+
     // Clear display
     ili9341_write_frame_gb(NULL, true);
 
     // Audio hardware
-    odroid_audio_init(odroid_settings_AudioSink_get(), AUDIO_SAMPLE_RATE);
+    odroid_audio_init(odroid_settings_AudioSink_get(), audioSampleRate);
 
     // Allocate display buffers
-    displayBuffer[0] = heap_caps_malloc(160 * 144 * 2, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-    displayBuffer[1] = heap_caps_malloc(160 * 144 * 2, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-
-    if (displayBuffer[0] == 0 || displayBuffer[1] == 0)
-        abort();
-
-    framebuffer = displayBuffer[0];
-
-    for (int i = 0; i < 2; ++i)
+    for (int i = 0; i < ODROID_FRAMEMAILBOX_SLOTS; ++i)
     {
+        displayBuffer[i] = heap_caps_malloc(160 * 144 * 2, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
+        if (displayBuffer[i] == 0)
+            abort();
+
         memset(displayBuffer[i], 0, 160 * 144 * 2);
     }
 
-    printf("app_main: displayBuffer[0]=%p, [1]=%p\n", displayBuffer[0], displayBuffer[1]);
+    odroid_framemailbox_init(&frameMailbox, displayBuffer[0], displayBuffer[1], displayBuffer[2]);
+    framebuffer = displayBuffer[odroid_framemailbox_back_get(&frameMailbox)];
+
+    printf("app_main: displayBuffer[0]=%p, [1]=%p, [2]=%p\n", displayBuffer[0], displayBuffer[1], displayBuffer[2]);
 
     // blue led
     gpio_set_direction(GPIO_NUM_2, GPIO_MODE_OUTPUT);
@@ -518,11 +536,8 @@ void app_main(void)
     odroid_input_battery_level_init();
 
     // video
-    vidQueue = xQueueCreate(1, sizeof(uint16_t*));
-    audioQueue = xQueueCreate(1, sizeof(uint16_t*));
 
     xTaskCreatePinnedToCore(&videoTask, "videoTask", 1024, NULL, 5, NULL, 1);
-    xTaskCreatePinnedToCore(&audioTask, "audioTask", 2048, NULL, 5, NULL, 1); //768
 
 
     //debug_trace = 1;
@@ -549,22 +564,19 @@ void app_main(void)
 
 
     // Note: Magic number obtained by adjusting until audio buffer overflows stop.
-    const int audioBufferLength = AUDIO_SAMPLE_RATE / 10 + 1;
+    const int audioBufferLength = audioSampleRate / 10 + 1;
     //printf("CHECKPOINT AUDIO: HEAP:0x%x - allocating 0x%x\n", esp_get_free_heap_size(), audioBufferLength * sizeof(int16_t) * 2 * 2);
     const int AUDIO_BUFFER_SIZE = audioBufferLength * sizeof(int16_t) * 2;
 
     // pcm.len = count of 16bit samples (x2 for stereo)
     memset(&pcm, 0, sizeof(pcm));
-    pcm.hz = AUDIO_SAMPLE_RATE;
+    pcm.hz = audioSampleRate;
   	pcm.stereo = 1;
   	pcm.len = /*pcm.hz / 2*/ audioBufferLength;
   	pcm.buf = heap_caps_malloc(AUDIO_BUFFER_SIZE, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
   	pcm.pos = 0;
 
-    audioBuffer[0] = pcm.buf;
-    audioBuffer[1] = heap_caps_malloc(AUDIO_BUFFER_SIZE, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-
-    if (audioBuffer[0] == 0 || audioBuffer[1] == 0)
+    if (pcm.buf == 0)
         abort();
 
 
@@ -595,13 +607,21 @@ void app_main(void)
 
 
     scaling_enabled = odroid_settings_ScaleDisabled_get(ODROID_SCALE_DISABLE_GB) ? false : true;
+    update_pixel_order();
+
+    // The Game Boy refreshes every 70224 cycles of its 4.19 MHz clock
+    odroid_framepace_init(&framePace, 4194304.0f / 70224, CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000, NULL);
+    odroid_framepace_frameskip_set(&framePace, profile.frameSkip);
+
+    cpu_pollskip = (profile.idleSkip == ODROID_PROFILE_INHERIT) ? IDLE_SKIP_DEFAULT : profile.idleSkip;
+    printf("app_main: idle loop skip %s\n", cpu_pollskip ? "on" : "off");
 
-    odroid_input_gamepad_read(&lastJoysticState);
+    odroid_input_events_begin(&lastJoysticState);
 
     while (true)
     {
-        odroid_gamepad_state joystick;
-        odroid_input_gamepad_read(&joystick);
+        odroid_gamepad_state joystick = lastJoysticState;
+        odroid_input_events_apply(&joystick);
 
         if (ignoreMenuButton)
         {
@@ -652,8 +672,20 @@ void app_main(void)
         {
             scaling_enabled = !scaling_enabled;
             odroid_settings_ScaleDisabled_set(ODROID_SCALE_DISABLE_GB, scaling_enabled ? 0 : 1);
+            update_pixel_order();
         }
 
+        // Idle loop skip, stored in the ROM profile
+        if (joystick.values[ODROID_INPUT_START] && !lastJoysticState.values[ODROID_INPUT_LEFT] && joystick.values[ODROID_INPUT_LEFT])
+        {
+            cpu_pollskip = !cpu_pollskip;
+
+            odroid_settings_RomProfile_get(&profile);
+            profile.idleSkip = cpu_pollskip;
+            odroid_settings_RomProfile_set(&profile);
+
+            printf("main: idle loop skip %s\n", cpu_pollskip ? "on" : "off");
+        }
 
         pad_set(PAD_UP, joystick.values[ODROID_INPUT_UP]);
         pad_set(PAD_RIGHT, joystick.values[ODROID_INPUT_RIGHT]);
@@ -689,7 +721,46 @@ void app_main(void)
           float seconds = totalElapsedTime / (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000.0f); // 240000000.0f; // (240Mhz)
           float fps = actualFrameCount / seconds;
 
-          printf("HEAP:0x%x, FPS:%f, BATTERY:%d [%d]\n", esp_get_free_heap_size(), fps, battery_state.millivolts, battery_state.percentage);
+          printf("HEAP:0x%x, FPS:%f, BATTERY:%d [%d], SKIP:%d\n", esp_get_free_heap_size(), fps, battery_state.millivolts, battery_state.percentage, odroid_display_delta_skipped_lines_get());
+
+          odroid_display_stats displayStats;
+          odroid_display_stats_get(&displayStats);
+          printf("DISPLAY: FRAMES:%d, LINEWAIT:%dus, SPIWAIT:%dus, DEPTH:%.2f [%d]\n", displayStats.frames,
+              displayStats.lineWaitMicros, displayStats.spiWaitMicros, displayStats.depthAverage, displayStats.depthMax);
+
+          printf("PACE: PRESENTED:%d, DROPPED:%d\n", framePace.framesPresented, framePace.framesDropped);
+          framePace.framesPresented = 0;
+          framePace.framesDropped = 0;
+
+          struct lcd_stats lcdStats;
+          lcd_stats_get(&lcdStats);
+          printf("LCD: LINES:%d, SKIPPED:%d, COPIED:%d\n", lcdStats.lines, lcdStats.skipped, lcdStats.copied);
+
+          struct cpu_stats cpuStats;
+          cpu_stats_get(&cpuStats);
+          printf("CPU: IDLE LOOPS:%d, SKIPPED:%d\n", cpuStats.loops, cpuStats.skipped);
+
+          odroid_framemailbox_stats mailboxStats;
+          odroid_framemailbox_stats_get(&frameMailbox, &mailboxStats);
+          printf("MAILBOX: PRESENTED:%d, DROPPED:%d\n", mailboxStats.framesPresented, mailboxStats.framesDropped);
+
+          odroid_audio_stats audioStats;
+          odroid_audio_stats_get(&audioStats);
+          printf("AUDIO: FILL:%d/%d [%d], UNDERRUNS:%d, OVERRUNS:%d, DROPPED:%d, RATE:%+dppm\n", audioStats.fill, audioStats.capacity,
+              audioStats.fillMin, audioStats.underruns, audioStats.overruns, audioStats.droppedFrames, audioStats.rateAdjustPpm);
+
+          odroid_input_stats inputStats;
+          odroid_input_stats_get(&inputStats);
+          printf("INPUT: EVENTS:%d, DROPPED:%d, LATENCY:%dus\n", inputStats.events, inputStats.dropped, inputStats.latencyMicros);
+
+          odroid_sdcard_stats sdcardStats;
+          odroid_sdcard_stats_get(&sdcardStats);
+          if (sdcardStats.bytes)
+          {
+              printf("SDCARD: READ:%dKB, TIME:%dus, RATE:%dKB/s, PREFETCHED:%d, HITS:%d, MISSES:%d, EVICTIONS:%d\n",
+                  sdcardStats.bytes / 1024, sdcardStats.micros, sdcardStats.kilobytesPerSecond, sdcardStats.prefetched,
+                  sdcardStats.hits, sdcardStats.misses, sdcardStats.evictions);
+          }
 
           actualFrameCount = 0;
           totalElapsedTime = 0;
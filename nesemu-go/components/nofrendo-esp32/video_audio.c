@@ -18,6 +18,7 @@
 #include <freertos/queue.h>
 #include "esp_partition.h"
 #include "esp_ota_ops.h"
+#include "esp_heap_caps.h"
 #include "driver/rtc_io.h"
 
 //Nes stuff wants to define this as well...
@@ -49,6 +50,8 @@
 #include "../odroid/odroid_system.h"
 #include "../odroid/odroid_display.h"
 #include "../odroid/odroid_input.h"
+#include "../odroid/odroid_framepace.h"
+#include "../odroid/odroid_framemailbox.h"
 
 
 #define DEFAULT_SAMPLERATE   32000
@@ -57,6 +60,8 @@
 #define  DEFAULT_WIDTH        256
 #define  DEFAULT_HEIGHT       NES_VISIBLE_HEIGHT
 
+static int sampleRate = DEFAULT_SAMPLERATE;
+
 odroid_volume_level Volume;
 odroid_battery_state battery;
 int scaling_enabled = 1;
@@ -80,7 +85,7 @@ static void (*audio_callback)(void *buffer, int length) = NULL;
 
 void do_audio_frame() {
 #if CONFIG_SOUND_ENA
-		int remaining = DEFAULT_SAMPLERATE / NES_REFRESH_RATE;
+		int remaining = sampleRate / NES_REFRESH_RATE;
 		while(remaining)
 		{
 			int n=DEFAULT_FRAGSIZE;
@@ -122,7 +127,11 @@ static int osd_init_sound(void)
 
 	audio_frame=malloc(4*DEFAULT_FRAGSIZE);
 
-    odroid_audio_init(odroid_settings_AudioSink_get(), DEFAULT_SAMPLERATE);
+    odroid_rom_profile profile;
+    odroid_settings_RomProfile_get(&profile);
+    if (profile.audioSampleRate) sampleRate = profile.audioSampleRate;
+
+    odroid_audio_init(odroid_settings_AudioSink_get(), sampleRate);
 
 #endif
 
@@ -133,7 +142,7 @@ static int osd_init_sound(void)
 
 void osd_getsoundinfo(sndinfo_t *info)
 {
-   info->sample_rate = DEFAULT_SAMPLERATE;
+   info->sample_rate = sampleRate;
    info->bps = 16;
 }
 
@@ -151,7 +160,8 @@ static void free_write(int num_dirties, rect_t *dirty_rects);
 static void custom_blit(bitmap_t *bmp, int num_dirties, rect_t *dirty_rects);
 static char fb[1]; //dummy
 
-QueueHandle_t vidQueue;
+odroid_framemailbox frameMailbox;
+extern odroid_framepace framePace;
 
 viddriver_t sdlDriver =
 {
@@ -238,14 +248,27 @@ static void free_write(int num_dirties, rect_t *dirty_rects)
    bmp_destroy(&myBitmap);
 }
 
-static uint8_t lcdfb[256 * 224];
+static uint8_t* lcdfb[ODROID_FRAMEMAILBOX_SLOTS];
+static odroid_rect lcdfb_dirties[ODROID_FRAMEMAILBOX_SLOTS][ODROID_RECTS_MAX];
+static int lcdfb_num_dirties[ODROID_FRAMEMAILBOX_SLOTS];
 static void custom_blit(bitmap_t *bmp, int num_dirties, rect_t *dirty_rects) {
     if (bmp->line[0] != NULL)
     {
-        memcpy(lcdfb, bmp->line[0], 256 * 224);
+        int slot = odroid_framemailbox_back_get(&frameMailbox);
+
+        memcpy(lcdfb[slot], bmp->line[0], 256 * 224);
+
+        // -1 (or too many) redraws the whole frame
+        lcdfb_num_dirties[slot] = (num_dirties > ODROID_RECTS_MAX) ? -1 : num_dirties;
+        for (int i = 0; i < lcdfb_num_dirties[slot]; ++i)
+        {
+            lcdfb_dirties[slot][i].left = dirty_rects[i].x;
+            lcdfb_dirties[slot][i].top = dirty_rects[i].y;
+            lcdfb_dirties[slot][i].width = dirty_rects[i].w;
+            lcdfb_dirties[slot][i].height = dirty_rects[i].h;
+        }
 
-        void* arg = (void*)lcdfb;
-    	xQueueSend(vidQueue, &arg, portMAX_DELAY);
+        odroid_framemailbox_publish(&frameMailbox);
     }
 }
 
@@ -254,25 +277,44 @@ static void custom_blit(bitmap_t *bmp, int num_dirties, rect_t *dirty_rects) {
 volatile bool exitVideoTaskFlag = false;
 static void videoTask(void *arg) {
     uint8_t* bmp = NULL;
+    uint32_t lastSequence = 0;
 
     while(1)
 	{
-		xQueuePeek(vidQueue, &bmp, portMAX_DELAY);
+        int slot = odroid_framemailbox_acquire(&frameMailbox);
+
+        if (slot < 0) break;
+
+        bmp = lcdfb[slot];
 
-        if (bmp == 1) break;
+        // Dirty rectangles are relative to the previous published frame,
+        // so redraw everything after a dropped frame
+        bool fullFrame = (lcdfb_num_dirties[slot] < 0) ||
+            (frameMailbox.sequence[slot] != lastSequence + 1);
+        lastSequence = frameMailbox.sequence[slot];
 
         if (previous_scaling_enabled != scaling_enabled)
         {
             // Clear display
             ili9341_write_frame_nes(NULL, NULL, true);
             previous_scaling_enabled = scaling_enabled;
+            fullFrame = true;
         }
 
-        ili9341_write_frame_nes(bmp, myPalette, scaling_enabled);
+        odroid_framepace_present_begin(&framePace);
 
-        odroid_input_battery_level_read(&battery);
+        if (fullFrame)
+        {
+            ili9341_write_frame_nes(bmp, myPalette, scaling_enabled);
+        }
+        else
+        {
+            ili9341_write_frame_nes_rects(bmp, myPalette, scaling_enabled, lcdfb_dirties[slot], lcdfb_num_dirties[slot]);
+        }
 
-		xQueueReceive(vidQueue, &bmp, portMAX_DELAY);
+        odroid_framepace_present_end(&framePace);
+
+        odroid_input_battery_level_read(&battery);
 	}
 
 
@@ -317,15 +359,13 @@ static void SaveState()
 
 static void PowerDown()
 {
-    uint16_t* param = 1;
-
     // Clear audio to prevent studdering
     odroid_audio_terminate();
 
     // Stop tasks
     printf("PowerDown: stopping tasks.\n");
 
-    xQueueSend(vidQueue, &param, portMAX_DELAY);
+    odroid_framemailbox_close(&frameMailbox);
     while (!exitVideoTaskFlag) { vTaskDelay(1); }
 
 
@@ -357,8 +397,8 @@ static int ConvertJoystickInput()
     }
 
 
-    odroid_gamepad_state state;
-    odroid_input_gamepad_read(&state);
+    odroid_gamepad_state state = previousJoystickState;
+    odroid_input_events_apply(&state);
 
 	int result = 0;
 
@@ -415,7 +455,7 @@ static int ConvertJoystickInput()
     }
 
     // Note: this will cause an exception on 2nd Core in Debug mode
-    if (powerFrameCount > /*60*/ 30 * 2)
+    if (powerFrameCount > 60 * 2)
     {
         // Turn Blue LED on. Power state change turns it off
         gpio_set_level(GPIO_NUM_2, 1);
@@ -429,8 +469,7 @@ static int ConvertJoystickInput()
 
         printf("Stopping video queue.\n");
 
-        void* arg = 1;
-        xQueueSend(vidQueue, &arg, portMAX_DELAY);
+        odroid_framemailbox_close(&frameMailbox);
         while(exitVideoTaskFlag)
         {
              vTaskDelay(10);
@@ -534,14 +573,20 @@ int osd_init()
 
     scaling_enabled = odroid_settings_ScaleDisabled_get(ODROID_SCALE_DISABLE_NES) ? false : true;
 
-    previousJoystickState = odroid_input_read_raw();
+    odroid_input_events_begin(&previousJoystickState);
     ignoreMenuButton = previousJoystickState.values[ODROID_INPUT_MENU];
 
 
 	ili9341_write_frame_nes(NULL, NULL, true);
 
 
-	vidQueue=xQueueCreate(1, sizeof(bitmap_t *));
+    for (int i = 0; i < ODROID_FRAMEMAILBOX_SLOTS; ++i)
+    {
+        lcdfb[i] = heap_caps_malloc(256 * 224, MALLOC_CAP_8BIT);
+        if (!lcdfb[i]) abort();
+    }
+
+    odroid_framemailbox_init(&frameMailbox, lcdfb[0], lcdfb[1], lcdfb[2]);
 	xTaskCreatePinnedToCore(&videoTask, "videoTask", 2048, NULL, 5, NULL, 1);
 
     osd_initinput();
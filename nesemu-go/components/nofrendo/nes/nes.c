@@ -42,6 +42,11 @@
 
 #include "esp_system.h"
 #include "../../odroid/odroid_input.h"
+#include "../../odroid/odroid_settings.h"
+#include "../../odroid/odroid_display.h"
+#include "../../odroid/odroid_audio.h"
+#include "../../odroid/odroid_framepace.h"
+#include "../../odroid/odroid_framemailbox.h"
 
 
 #define  NES_CLOCK_DIVIDER    12
@@ -356,11 +361,11 @@ static void system_video(bool draw)
 
    /* blit to screen */
    vid_flush();
-
-   /* grab input */
-   osd_getinput();
 }
 
+odroid_framepace framePace;
+extern odroid_framemailbox frameMailbox;
+
 extern void do_audio_frame();
 extern bool forceConsoleReset;
 
@@ -380,9 +385,16 @@ void nes_emulate(void)
    uint stopTime;
    uint totalElapsedTime = 0;
    int frame = 0;
-   int skipFrame = 0;
 
 
+   // The warm-up frames below are presented, and the video task paces
+   // them, so the pacer must be ready first
+   odroid_framepace_init(&framePace, NES_REFRESH_RATE, CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000, NULL);
+
+   odroid_rom_profile profile;
+   odroid_settings_RomProfile_get(&profile);
+   odroid_framepace_frameskip_set(&framePace, profile.frameSkip);
+
    for (int i = 0; i < 4; ++i)
    {
        nes_renderframe(1);
@@ -400,14 +412,14 @@ void nes_emulate(void)
    {
        startTime = xthal_get_ccount();
 
-        bool renderFrame = ((skipFrame % 2) == 0);
+        bool renderFrame = (odroid_framepace_frame_begin(&framePace) == ODROID_FRAME_PRESENT);
+
+        /* grab input every frame, rendered or not */
+        osd_getinput();
 
         nes_renderframe(renderFrame);
         system_video(renderFrame);
 
-        if (skipFrame % 7 == 0) ++skipFrame;
-        ++skipFrame;
-
         do_audio_frame();
 
         stopTime = xthal_get_ccount();
@@ -426,7 +438,29 @@ void nes_emulate(void)
           float seconds = totalElapsedTime / (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000.0f);
           float fps = frame / seconds;
 
-          printf("HEAP:0x%x, FPS:%f, BATTERY:%d [%d]\n", esp_get_free_heap_size(), fps, battery.millivolts, battery.percentage);
+          printf("HEAP:0x%x, FPS:%f, BATTERY:%d [%d], SKIP:%d\n", esp_get_free_heap_size(), fps, battery.millivolts, battery.percentage, odroid_display_delta_skipped_lines_get());
+
+          odroid_display_stats displayStats;
+          odroid_display_stats_get(&displayStats);
+          printf("DISPLAY: FRAMES:%d, LINEWAIT:%dus, SPIWAIT:%dus, DEPTH:%.2f [%d]\n", displayStats.frames,
+              displayStats.lineWaitMicros, displayStats.spiWaitMicros, displayStats.depthAverage, displayStats.depthMax);
+
+          printf("PACE: PRESENTED:%d, DROPPED:%d\n", framePace.framesPresented, framePace.framesDropped);
+          framePace.framesPresented = 0;
+          framePace.framesDropped = 0;
+
+          odroid_framemailbox_stats mailboxStats;
+          odroid_framemailbox_stats_get(&frameMailbox, &mailboxStats);
+          printf("MAILBOX: PRESENTED:%d, DROPPED:%d\n", mailboxStats.framesPresented, mailboxStats.framesDropped);
+
+          odroid_audio_stats audioStats;
+          odroid_audio_stats_get(&audioStats);
+          printf("AUDIO: FILL:%d/%d [%d], UNDERRUNS:%d, OVERRUNS:%d, DROPPED:%d, RATE:%+dppm\n", audioStats.fill, audioStats.capacity,
+              audioStats.fillMin, audioStats.underruns, audioStats.overruns, audioStats.droppedFrames, audioStats.rateAdjustPpm);
+
+          odroid_input_stats inputStats;
+          odroid_input_stats_get(&inputStats);
+          printf("INPUT: EVENTS:%d, DROPPED:%d, LATENCY:%dus\n", inputStats.events, inputStats.dropped, inputStats.latencyMicros);
 
           frame = 0;
           totalElapsedTime = 0;
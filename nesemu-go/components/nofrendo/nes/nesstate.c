@@ -37,6 +37,7 @@
 #include "../../odroid/odroid_sdcard.h"
 #include "../../odroid/odroid_settings.h"
 #include "../../odroid/odroid_display.h"
+#include "../../odroid/odroid_input.h"
 
 extern nes_t* console_nes;
 extern nes6502_context cpu;
@@ -559,7 +560,11 @@ void save_sram()
         char* pathName = odroid_sdcard_create_savefile_path(SD_BASE_PATH, fileName);
         if (!pathName) abort();
 
-        state_save(pathName);
+        // Scripted runs always start from power on
+        if (odroid_input_script_mode_get() != ODROID_INPUT_SCRIPT_NONE)
+            odroid_input_script_save();
+        else
+            state_save(pathName);
 
         free(pathName);
         free(fileName);
@@ -597,7 +602,8 @@ void load_sram()
         char* pathName = odroid_sdcard_create_savefile_path(SD_BASE_PATH, fileName);
         if (!pathName) abort();
 
-        state_load(pathName);
+        if (odroid_input_script_init(SD_BASE_PATH, romName) == ODROID_INPUT_SCRIPT_NONE)
+            state_load(pathName);
 
         free(pathName);
         free(fileName);
@@ -8,6 +8,7 @@
 #include "nofrendo.h"
 #include "esp_partition.h"
 #include "esp_spiffs.h"
+#include "rom/crc.h"
 
 #include "esp_err.h"
 #include "esp_log.h"
@@ -48,6 +49,8 @@ int app_main(void)
 
 	nvs_flash_init();
 
+	odroid_settings_init();
+
 	odroid_system_init();
 
 	esp_err_t ret;
@@ -129,6 +132,7 @@ int app_main(void)
     {
         forceConsoleReset = true;
         odroid_settings_StartAction_set(ODROID_START_ACTION_NORMAL);
+        odroid_settings_commit();
     }
 
 
@@ -175,6 +179,9 @@ int app_main(void)
             abort();
         }
 
+		// Per-ROM settings
+		odroid_settings_RomProfile_load(crc32_le(0, (const uint8_t*)ROM_DATA, fileSize));
+
 		r = odroid_sdcard_close();
 		if (r != ESP_OK)
         {
@@ -1,21 +1,138 @@
 #include "odroid_audio.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "driver/i2s.h"
 #include "driver/rtc_io.h"
+#endif
 
 
 
 #define I2S_NUM (I2S_NUM_0)
 
-static int AudioSink = ODROID_AUDIO_SINK_SPEAKER;
-static float Volume = 1.0f;
+// Speaker output swings 127 steps on each side of the differential pair
+#define SPEAKER_MAGNITUDE (127 + 127)
+#define SPEAKER_GAIN_SHIFT (15 + 8)
+#define DAC_GAIN_SHIFT (12)
+
+#define DMA_BUF_COUNT (6)
+#define DMA_BUF_LEN (512)
+
+// Stereo frames queued between the emulators and the feeder task
+#define RING_FRAMES (4096)
+#define RING_MASK (RING_FRAMES - 1)
+
+// The resampler steers the queue toward this fill level
+#define TARGET_FRAMES (RING_FRAMES / 4)
+
+// Largest rate correction, 0.5% of a Q16 step
+#define RESAMPLE_ONE (1 << 16)
+#define RESAMPLE_MAX_ADJUST (RESAMPLE_ONE / 200)
+
+// Frames converted and written to I2S per feeder pass
+#define FEED_FRAMES (256)
+
 static odroid_volume_level volumeLevel = ODROID_VOLUME_LEVEL3;
 static int volumeLevels[] = {0, 125, 250, 500, 1000};
+
+// Per volume level gains: SPEAKER_MAGNITUDE * volume in Q8, volume in Q12
+static int32_t speakerGain;
+static int32_t dacGain;
+
+// Packed dac1 | dac0 << 16 words for every speaker level
+static uint32_t speakerTable[SPEAKER_MAGNITUDE * 2 + 1];
+static bool speakerTableReady;
+
+#ifdef ESP_PLATFORM
+static int AudioSink = ODROID_AUDIO_SINK_SPEAKER;
 static int audio_sample_rate;
 
+// Single producer, single consumer ring of left/right frames
+static uint32_t* ring;
+static volatile uint32_t ring_head;     // frames written, owned by the producer
+static volatile uint32_t ring_tail;     // frames read, owned by the feeder
+static SemaphoreHandle_t ring_filled;
+static volatile bool feeder_stop;
+static volatile bool feeder_running;
+
+// Resampler state, owned by the producer
+static uint32_t resample_last;          // final frame of the previous submit
+static uint32_t resample_phase;         // Q16 position past the current input frame
+static int resample_fill;               // smoothed fill level in Q4
+static int resample_adjust;             // current step correction in Q16
+
+// Ring statistics. The totals only grow, each written by one side;
+// odroid_audio_stats_get reports their change since its previous call.
+static volatile uint32_t stats_underruns;       // feeder
+static volatile uint32_t stats_overruns;        // producer
+static volatile uint32_t stats_dropped_frames;  // producer
+
+// Each stats call starts a new period, and the feeder restarts the fill
+// minimum when it sees one
+static volatile uint32_t stats_period;
+static volatile uint32_t stats_fill_period;
+static volatile uint32_t stats_fill_min = RING_FRAMES;
+
+static struct
+{
+    uint32_t underruns;
+    uint32_t overruns;
+    uint32_t droppedFrames;
+} stats_reported;
+
+static void feeder_task(void* arg);
+#endif
+
+
+static void speaker_table_init()
+{
+    for (int level = -SPEAKER_MAGNITUDE; level <= SPEAKER_MAGNITUDE; ++level)
+    {
+        int dac0;
+        int dac1;
+
+        // Convert to differential output
+        if (level > 127)
+        {
+            dac1 = level - 127;
+            dac0 = 127;
+        }
+        else if (level < -127)
+        {
+            dac1 = level + 127;
+            dac0 = -127;
+        }
+        else
+        {
+            dac1 = 0;
+            dac0 = level;
+        }
+
+        uint16_t out0 = (uint16_t)((dac0 + 0x80) << 8);
+        uint16_t out1 = (uint16_t)((0x80 - dac1) << 8);
+
+        speakerTable[level + SPEAKER_MAGNITUDE] = out1 | ((uint32_t)out0 << 16);
+    }
+
+    speakerTableReady = true;
+}
+
+// Divides by 2^shift, rounding toward zero like a float to int conversion
+static inline int32_t gain_apply(int32_t sample, int32_t gain, int shift)
+{
+    int32_t value = sample * gain;
+    return (value + ((value >> 31) & ((1 << shift) - 1))) >> shift;
+}
+
 
 odroid_volume_level odroid_audio_volume_get()
 {
@@ -31,9 +148,72 @@ void odroid_audio_volume_set(odroid_volume_level value)
     }
 
     volumeLevel = value;
-    Volume = (float)volumeLevels[value] * 0.001f;
+
+    if (!speakerTableReady)
+        speaker_table_init();
+
+    speakerGain = (SPEAKER_MAGNITUDE * 256 * volumeLevels[value] + 500) / 1000;
+    dacGain = ((1 << DAC_GAIN_SHIFT) * volumeLevels[value] + 500) / 1000;
+}
+
+void odroid_audio_convert(ODROID_AUDIO_SINK sink, short* stereoAudioBuffer, int frameCount)
+{
+    // Each 32 bit word holds one left/right frame
+    uint32_t* frames = (uint32_t*)stereoAudioBuffer;
+
+    if (sink == ODROID_AUDIO_SINK_SPEAKER)
+    {
+        // Convert for built in DAC
+        if (speakerGain == 0)
+        {
+            // Disable amplifier
+            for (int i = 0; i < frameCount; ++i)
+            {
+                frames[i] = 0;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < frameCount; ++i)
+            {
+                // Down mix stero to mono
+                const uint32_t frame = frames[i];
+                const int32_t sample = ((int32_t)(int16_t)frame + (int32_t)(int16_t)(frame >> 16)) >> 1;
+
+                const int32_t level = gain_apply(sample, speakerGain, SPEAKER_GAIN_SHIFT);
+                frames[i] = speakerTable[level + SPEAKER_MAGNITUDE];
+            }
+        }
+    }
+    else if (sink == ODROID_AUDIO_SINK_DAC)
+    {
+        for (int i = 0; i < frameCount; ++i)
+        {
+            const uint32_t frame = frames[i];
+
+            int32_t left = gain_apply((int16_t)frame, dacGain, DAC_GAIN_SHIFT);
+            int32_t right = gain_apply((int16_t)(frame >> 16), dacGain, DAC_GAIN_SHIFT);
+
+            if (left > 32767)
+                left = 32767;
+            else if (left < -32768)
+                left = -32767;
+
+            if (right > 32767)
+                right = 32767;
+            else if (right < -32768)
+                right = -32767;
+
+            frames[i] = (uint16_t)left | ((uint32_t)(uint16_t)right << 16);
+        }
+    }
+    else
+    {
+        abort();
+    }
 }
 
+#ifdef ESP_PLATFORM
 void odroid_audio_volume_change()
 {
     int level = (volumeLevel + 1) % ODROID_VOLUME_LEVEL_COUNT;
@@ -60,9 +240,9 @@ void odroid_audio_init(ODROID_AUDIO_SINK sink, int sample_rate)
             .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,                           //2-channels
             .communication_format = I2S_COMM_FORMAT_I2S_MSB,
             //.communication_format = I2S_COMM_FORMAT_PCM,
-            .dma_buf_count = 6,
+            .dma_buf_count = DMA_BUF_COUNT,
             //.dma_buf_len = 1472 / 2,  // (368samples * 2ch * 2(short)) = 1472
-            .dma_buf_len = 512,  // (416samples * 2ch * 2(short)) = 1664
+            .dma_buf_len = DMA_BUF_LEN,  // (416samples * 2ch * 2(short)) = 1664
             .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,                                //Interrupt level 1
             .use_apll = 0 //1
         };
@@ -80,9 +260,9 @@ void odroid_audio_init(ODROID_AUDIO_SINK sink, int sample_rate)
             .bits_per_sample = 16,
             .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,                           //2-channels
             .communication_format = I2S_COMM_FORMAT_I2S | I2S_COMM_FORMAT_I2S_MSB,
-            .dma_buf_count = 6,
+            .dma_buf_count = DMA_BUF_COUNT,
             //.dma_buf_len = 1472 / 2,  // (368samples * 2ch * 2(short)) = 1472
-            .dma_buf_len = 512,  // (416samples * 2ch * 2(short)) = 1664
+            .dma_buf_len = DMA_BUF_LEN,  // (416samples * 2ch * 2(short)) = 1664
             .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,                                //Interrupt level 1
             .use_apll = 1
         };
@@ -126,10 +306,43 @@ void odroid_audio_init(ODROID_AUDIO_SINK sink, int sample_rate)
 
     odroid_volume_level level = odroid_settings_Volume_get();
     odroid_audio_volume_set(level);
+
+    // Feeder
+    if (!ring)
+    {
+        ring = heap_caps_malloc(RING_FRAMES * sizeof(uint32_t), MALLOC_CAP_8BIT);
+        if (!ring) abort();
+
+        ring_filled = xSemaphoreCreateBinary();
+        if (!ring_filled) abort();
+    }
+
+    ring_head = 0;
+    ring_tail = 0;
+
+    resample_last = 0;
+    resample_phase = 0;
+    resample_fill = TARGET_FRAMES << 4;
+    resample_adjust = 0;
+    feeder_stop = false;
+    feeder_running = true;
+
+    xTaskCreatePinnedToCore(&feeder_task, "audio_feeder", 2048, NULL, 6, NULL, 1);
 }
 
 void odroid_audio_terminate()
 {
+    // Stop the feeder, dropping anything still queued
+    if (feeder_running)
+    {
+        feeder_stop = true;
+        xSemaphoreGive(ring_filled);
+
+        while (feeder_running) { vTaskDelay(1); }
+    }
+
+    ring_tail = ring_head;
+
     i2s_zero_dma_buffer(I2S_NUM);
     i2s_stop(I2S_NUM);
 
@@ -158,104 +371,182 @@ void odroid_audio_terminate()
     }
 }
 
-void odroid_audio_submit(short* stereoAudioBuffer, int frameCount)
+static void audio_output(short* stereoAudioBuffer, int frameCount)
 {
-    short currentAudioSampleCount = frameCount * 2;
+    int len = frameCount * 2 * sizeof(int16_t);
 
-    if (AudioSink == ODROID_AUDIO_SINK_SPEAKER)
+    odroid_audio_convert(AudioSink, stereoAudioBuffer, frameCount);
+
+    int count = i2s_write_bytes(I2S_NUM, (const char *)stereoAudioBuffer, len, portMAX_DELAY);
+    if (count != len)
     {
-        // Convert for built in DAC
-        for (short i = 0; i < currentAudioSampleCount; i += 2)
-        {
-            uint16_t dac0;
-            uint16_t dac1;
+        printf("i2s_write_bytes: count (%d) != len (%d)\n", count, len);
+        abort();
+    }
+}
 
-            if (Volume == 0.0f)
-            {
-                // Disable amplifier
-                dac0 = 0;
-                dac1 = 0;
-            }
-            else
-            {
-                // Down mix stero to mono
-                int32_t sample = stereoAudioBuffer[i];
-                sample += stereoAudioBuffer[i + 1];
-                sample >>= 1;
-
-                // Normalize
-                const float sn = (float)sample / 0x8000;
-
-                // Scale
-                const int magnitude = 127 + 127;
-                const float range = magnitude  * sn * Volume;
-
-                // Convert to differential output
-                if (range > 127)
-                {
-                    dac1 = (range - 127);
-                    dac0 = 127;
-                }
-                else if (range < -127)
-                {
-                    dac1  = (range + 127);
-                    dac0 = -127;
-                }
-                else
-                {
-                    dac1 = 0;
-                    dac0 = range;
-                }
-
-                dac0 += 0x80;
-                dac1 = 0x80 - dac1;
-
-                dac0 <<= 8;
-                dac1 <<= 8;
-            }
+static void feeder_task(void* arg)
+{
+    static uint32_t frames[FEED_FRAMES];
+
+    // After a write returns I2S holds at least this much audio
+    const int64_t dmaMicros = (int64_t)(DMA_BUF_COUNT - 1) * DMA_BUF_LEN * 1000000 / audio_sample_rate;
+
+    bool playing = false;
+    int64_t lastWrite = 0;
+
+    feeder_running = true;
+
+    while (!feeder_stop)
+    {
+        const uint32_t tail = ring_tail;
+        uint32_t available = ring_head - tail;
 
-            stereoAudioBuffer[i] = (int16_t)dac1;
-            stereoAudioBuffer[i + 1] = (int16_t)dac0;
+        if (available == 0)
+        {
+            xSemaphoreTake(ring_filled, portMAX_DELAY);
+            continue;
         }
 
-        int len = currentAudioSampleCount * sizeof(int16_t);
-        int count = i2s_write_bytes(I2S_NUM, (const char *)stereoAudioBuffer, len, portMAX_DELAY);
-        if (count != len)
+        if (stats_fill_period != stats_period)
         {
-            printf("i2s_write_bytes: count (%d) != len (%d)\n", count, len);
-            abort();
+            stats_fill_period = stats_period;
+            stats_fill_min = RING_FRAMES;
         }
+        if (available < stats_fill_min)
+            stats_fill_min = available;
+
+        // Data arriving after I2S has played everything it was given
+        if (playing && esp_timer_get_time() - lastWrite > dmaMicros)
+            ++stats_underruns;
+
+        int count = (available > FEED_FRAMES) ? FEED_FRAMES : available;
+
+        int start = tail & RING_MASK;
+        int first = (start + count > RING_FRAMES) ? RING_FRAMES - start : count;
+        memcpy(frames, ring + start, first * sizeof(uint32_t));
+        memcpy(frames + first, ring, (count - first) * sizeof(uint32_t));
+
+        ring_tail = tail + count;
+
+        audio_output((short*)frames, count);
+
+        playing = true;
+        lastWrite = esp_timer_get_time();
     }
-    else if (AudioSink == ODROID_AUDIO_SINK_DAC)
-    {
-        int len = currentAudioSampleCount * sizeof(int16_t);
 
-        for (short i = 0; i < currentAudioSampleCount; ++i)
-        {
-            int sample = stereoAudioBuffer[i] * Volume;
+    feeder_running = false;
+    vTaskDelete(NULL);
 
-            if (sample > 32767)
-                sample = 32767;
-            else if (sample < -32768)
-                sample = -32767;
+    while (1) {}
+}
 
-            stereoAudioBuffer[i] = (short)sample;
-        }
+// Linear interpolation of both channels, fraction in Q15
+static inline uint32_t frame_lerp(uint32_t a, uint32_t b, int32_t fraction)
+{
+    int32_t left = (int16_t)a;
+    int32_t right = (int16_t)(a >> 16);
+
+    left += (((int16_t)b - left) * fraction) >> 15;
+    right += (((int16_t)(b >> 16) - right) * fraction) >> 15;
+
+    return (uint16_t)left | ((uint32_t)(uint16_t)right << 16);
+}
+
+void odroid_audio_submit(short* stereoAudioBuffer, int frameCount)
+{
+    if (frameCount < 1) return;
+
+    uint32_t head = ring_head;
+    const int fill = head - ring_tail;
+
+    // Emulation and I2S run on different clocks. Stretch or squeeze the
+    // input slightly to hold the queue near its target.
+    resample_fill += fill - (resample_fill >> 4);
+
+    int adjust = ((resample_fill >> 4) - TARGET_FRAMES) * RESAMPLE_MAX_ADJUST / TARGET_FRAMES;
+    if (adjust > RESAMPLE_MAX_ADJUST)
+        adjust = RESAMPLE_MAX_ADJUST;
+    else if (adjust < -RESAMPLE_MAX_ADJUST)
+        adjust = -RESAMPLE_MAX_ADJUST;
+
+    resample_adjust = adjust;
+
+    const uint32_t step = RESAMPLE_ONE + adjust;
+    const uint32_t* frames = (const uint32_t*)stereoAudioBuffer;
 
-        int count = i2s_write_bytes(I2S_NUM, (const char *)stereoAudioBuffer, len, portMAX_DELAY);
-        if (count != len)
+    int space = RING_FRAMES - fill;
+    int dropped = 0;
+
+    // Output frames lie between input frames index - 1 and index, where
+    // frame -1 is the last one of the previous submit
+    uint32_t phase = resample_phase;
+    int index = phase >> 16;
+    phase &= 0xffff;
+
+    while (index < frameCount)
+    {
+        const uint32_t previous = index ? frames[index - 1] : resample_last;
+
+        if (space > 0)
         {
-            printf("i2s_write_bytes: count (%d) != len (%d)\n", count, len);
-            abort();
+            ring[head & RING_MASK] = frame_lerp(previous, frames[index], phase >> 1);
+            ++head;
+            --space;
         }
+        else
+        {
+            ++dropped;
+        }
+
+        phase += step;
+        index += phase >> 16;
+        phase &= 0xffff;
     }
-    else
+
+    resample_last = frames[frameCount - 1];
+    resample_phase = ((uint32_t)(index - frameCount) << 16) | phase;
+
+    if (dropped)
     {
-        abort();
+        ++stats_overruns;
+        stats_dropped_frames += dropped;
     }
+
+    ring_head = head;
+
+    // Never blocks: a pending give already wakes the feeder
+    xSemaphoreGive(ring_filled);
+}
+
+void odroid_audio_stats_get(odroid_audio_stats* stats)
+{
+    // The totals are never reset, so counts made while this runs are
+    // reported next time instead of being lost
+    const uint32_t underruns = stats_underruns;
+    const uint32_t overruns = stats_overruns;
+    const uint32_t droppedFrames = stats_dropped_frames;
+
+    // The minimum belongs to this period only once the feeder restarted it
+    const uint32_t period = stats_period;
+    const uint32_t fillMin = (stats_fill_period == period) ? stats_fill_min : RING_FRAMES;
+    stats_period = period + 1;
+
+    stats->capacity = RING_FRAMES;
+    stats->fill = ring_head - ring_tail;
+    stats->fillMin = (fillMin == RING_FRAMES) ? stats->fill : fillMin;
+    stats->underruns = underruns - stats_reported.underruns;
+    stats->overruns = overruns - stats_reported.overruns;
+    stats->droppedFrames = droppedFrames - stats_reported.droppedFrames;
+    stats->rateAdjustPpm = (int64_t)resample_adjust * 1000000 / RESAMPLE_ONE;
+
+    stats_reported.underruns = underruns;
+    stats_reported.overruns = overruns;
+    stats_reported.droppedFrames = droppedFrames;
 }
 
 int odroid_audio_sample_rate_get()
 {
     return audio_sample_rate;
 }
+#endif
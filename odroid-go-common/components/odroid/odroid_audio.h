@@ -21,5 +21,28 @@ void odroid_audio_volume_set(odroid_volume_level value);
 void odroid_audio_volume_change();
 void odroid_audio_init(ODROID_AUDIO_SINK sink, int sample_rate);
 void odroid_audio_terminate();
+
+// Queues frames for the feeder task without blocking. The frames are
+// resampled by up to 0.5% to hold the queue near a quarter full. Frames
+// that still do not fit are dropped and counted as an overrun.
 void odroid_audio_submit(short* stereoAudioBuffer, int frameCount);
+
 int odroid_audio_sample_rate_get();
+
+// Converts left/right frames in place to the output format of the sink at
+// the current volume. The feeder task does this to everything it writes.
+void odroid_audio_convert(ODROID_AUDIO_SINK sink, short* stereoAudioBuffer, int frameCount);
+
+typedef struct
+{
+    uint32_t capacity;          // frames the queue can hold
+    uint32_t fill;              // frames queued now
+    uint32_t fillMin;           // lowest fill when the feeder took data
+    uint32_t underruns;         // I2S ran dry before more data arrived
+    uint32_t overruns;          // submits that did not fit
+    uint32_t droppedFrames;
+    int32_t rateAdjustPpm;      // current resampler correction
+} odroid_audio_stats;
+
+// Returns the totals since the previous call. Call from one task only.
+void odroid_audio_stats_get(odroid_audio_stats* stats);
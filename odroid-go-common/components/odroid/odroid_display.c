@@ -14,6 +14,7 @@
 #include "driver/spi_master.h"
 #include "driver/ledc.h"
 #include "driver/rtc_io.h"
+#include "esp_heap_caps.h"
 
 #include <string.h>
 
@@ -31,14 +32,18 @@ const int LCD_BACKLIGHT_ON_VALUE = 1;
 const int LCD_SPI_CLOCK_RATE = 40000000;
 
 
-#define SPI_TRANSACTION_COUNT (4)
-static spi_transaction_t trans[SPI_TRANSACTION_COUNT];
+static spi_transaction_t* trans;
+static int spi_transaction_count;
 static spi_device_handle_t spi;
 
 
-#define LINE_BUFFERS (2)
-#define LINE_COUNT (5)
-uint16_t* line[LINE_BUFFERS];
+// Line buffer pool, see odroid_display_pipeline_set
+#define LINE_BUFFERS_DEFAULT (2)
+#define LINE_BUFFERS_MAX (8)
+#define LINE_COUNT_DEFAULT (5)
+static int line_buffers = LINE_BUFFERS_DEFAULT;
+static int line_count = LINE_COUNT_DEFAULT;
+uint16_t* line[LINE_BUFFERS_MAX];
 QueueHandle_t spi_queue;
 QueueHandle_t line_buffer_queue;
 SemaphoreHandle_t line_semaphore;
@@ -49,6 +54,56 @@ SemaphoreHandle_t spi_count_semaphore;
 bool isBackLightIntialized = false;
 
 
+// Direct (zero-copy) submissions still being read by DMA
+static bool direct_pending;
+
+
+// Pipeline statistics. The totals only grow and are written by the
+// display side only; odroid_display_stats_get reports their change since
+// its previous call. Waits are summed in microseconds, carrying the cycles
+// left over, so that every total is a single 32 bit word.
+static volatile uint32_t stats_frames;
+static volatile uint32_t stats_line_wait_micros;
+static volatile uint32_t stats_spi_wait_micros;
+static volatile uint32_t stats_depth_sum;
+static volatile uint32_t stats_depth_samples;
+static volatile uint32_t stats_skipped_lines;
+static uint32_t stats_line_wait_cycles;
+static uint32_t stats_spi_wait_cycles;
+
+// A maximum cannot be reported as a change. Each stats call starts a new
+// period, and the display side restarts the maximum when it sees one.
+static volatile uint32_t stats_period;
+static volatile uint32_t stats_depth_period;
+static volatile uint32_t stats_depth_max;
+
+static struct
+{
+    uint32_t frames;
+    uint32_t lineWaitMicros;
+    uint32_t spiWaitMicros;
+    uint32_t depthSum;
+    uint32_t depthSamples;
+    uint32_t skippedLines;
+} stats_reported;
+
+
+// Delta frame transmission
+#define DELTA_MAX_BLOCKS (240)
+static bool delta_enabled = true;
+static bool delta_valid = false;
+static uint32_t delta_key;
+static uint32_t delta_hash[DELTA_MAX_BLOCKS];
+static short delta_left;
+static short delta_top;
+static short delta_width;
+static short delta_height;
+static short delta_next_line;
+static bool delta_sent;
+static int delta_skipped;
+static int delta_skipped_last;
+
+
  // GB
 #define GAMEBOY_WIDTH (160)
 #define GAMEBOY_HEIGHT (144)
@@ -60,13 +115,15 @@ bool isBackLightIntialized = false;
 
 #define GAMEGEAR_WIDTH (160)
 #define GAMEGEAR_HEIGHT (144)
+#define GAMEGEAR_LEFT (48)
 
-#define PIXEL_MASK          (0x1F)
+#define SMS_PALETTE_SIZE (32)
 
 
 // NES
 #define NES_GAME_WIDTH (256)
 #define NES_GAME_HEIGHT (224) /* NES_VISIBLE_HEIGHT */
+#define NES_PALETTE_SIZE (64)
 
 
 /*
@@ -143,14 +200,38 @@ DRAM_ATTR static const ili_init_cmd_t ili_init_cmds[] = {
     {0, {0}, 0xff}
 };
 
+static void stats_wait_add(volatile uint32_t* micros, uint32_t* cycles, uint32_t elapsed)
+{
+    *cycles += elapsed;
+    *micros += *cycles / CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+    *cycles %= CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+}
+
 static uint16_t* line_buffer_get()
 {
+    // buffers owned by the SPI side
+    uint32_t depth = line_buffers - uxQueueMessagesWaiting(line_buffer_queue);
+
+    stats_depth_sum += depth;
+    ++stats_depth_samples;
+
+    if (stats_depth_period != stats_period)
+    {
+        stats_depth_period = stats_period;
+        stats_depth_max = 0;
+    }
+    if (depth > stats_depth_max) stats_depth_max = depth;
+
+    uint32_t startTime = xthal_get_ccount();
+
     uint16_t* buffer;
     if (xQueueReceive(line_buffer_queue, &buffer, 1000 / portTICK_RATE_MS) != pdTRUE)
     {
         abort();
     }
 
+    stats_wait_add(&stats_line_wait_micros, &stats_line_wait_cycles, xthal_get_ccount() - startTime);
+
     return buffer;
 }
 
@@ -189,7 +270,7 @@ static void spi_task(void *arg)
                 abort();
             }
 
-            if(uxQueueMessagesWaiting(spi_queue) >= SPI_TRANSACTION_COUNT)
+            if(uxQueueMessagesWaiting(spi_queue) >= spi_transaction_count)
             {
                 xSemaphoreGive(spi_empty);
             }
@@ -208,15 +289,22 @@ static void spi_task(void *arg)
 
 static void spi_initialize()
 {
-    spi_queue = xQueueCreate(SPI_TRANSACTION_COUNT, sizeof(void*));
+    // A command and a data transaction per line buffer in flight
+    spi_transaction_count = line_buffers * 2;
+
+    trans = heap_caps_malloc(spi_transaction_count * sizeof(spi_transaction_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!trans) abort();
+
+
+    spi_queue = xQueueCreate(spi_transaction_count, sizeof(void*));
     if(!spi_queue) abort();
 
 
-    line_buffer_queue = xQueueCreate(LINE_BUFFERS, sizeof(void*));
+    line_buffer_queue = xQueueCreate(line_buffers, sizeof(void*));
     if(!line_buffer_queue) abort();
 
 
-    line_semaphore = xSemaphoreCreateCounting(LINE_BUFFERS, LINE_BUFFERS);
+    line_semaphore = xSemaphoreCreateCounting(line_buffers, line_buffers);
     if (!line_semaphore) abort();
 
 
@@ -226,7 +314,7 @@ static void spi_initialize()
     xSemaphoreGive(spi_empty);
 
 
-    spi_count_semaphore = xSemaphoreCreateCounting(SPI_TRANSACTION_COUNT, 0);
+    spi_count_semaphore = xSemaphoreCreateCounting(spi_transaction_count, 0);
     if (!spi_count_semaphore) abort();
 
     xTaskCreatePinnedToCore(&spi_task, "spi_task", 1024 + 768, NULL, 5, NULL, 1);
@@ -371,10 +459,17 @@ void send_reset_drawing(int left, int top, int width, int height)
 
 void send_continue_wait()
 {
+    uint32_t startTime = xthal_get_ccount();
+
     if(xSemaphoreTake(spi_empty, 1000 / portTICK_RATE_MS) != pdTRUE )
     {
         abort();
     }
+
+    stats_wait_add(&stats_spi_wait_micros, &stats_spi_wait_cycles, xthal_get_ccount() - startTime);
+
+    // Everything queued so far has completed
+    direct_pending = false;
 }
 
 void send_continue_line(uint16_t *line, int width, int lineCount)
@@ -403,6 +498,204 @@ void send_continue_line(uint16_t *line, int width, int lineCount)
     spi_put_transaction(t);
 }
 
+static uint32_t delta_hash_rows(const uint8_t* src, int rowBytes, int stride, int rows)
+{
+    // FNV-1a over 32-bit words. Any single word change alters the result.
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < rows; ++i)
+    {
+        const uint32_t* data = (const uint32_t*)(src + i * stride);
+
+        for (int j = 0; j < rowBytes / 4; ++j)
+        {
+            hash = (hash ^ data[j]) * 16777619u;
+        }
+
+        for (int j = rowBytes & ~3; j < rowBytes; ++j)
+        {
+            hash = (hash ^ src[i * stride + j]) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+static void delta_invalidate()
+{
+    delta_valid = false;
+}
+
+static void delta_frame_begin(uint32_t key, short left, short top, short width, short height)
+{
+    if (!delta_enabled || key != delta_key)
+    {
+        delta_valid = false;
+    }
+
+    delta_key = key;
+    delta_left = left;
+    delta_top = top;
+    delta_width = width;
+    delta_height = height;
+    delta_next_line = -1;
+    delta_sent = false;
+    delta_skipped = 0;
+}
+
+// Returns true if the block needs to be sent. Must be called for every
+// block of every frame so the stored hashes stay current.
+static bool delta_block_dirty(int block, const uint8_t* src, int rowBytes, int stride, int rows)
+{
+    if (!delta_enabled || block >= DELTA_MAX_BLOCKS) return true;
+
+    uint32_t hash = delta_hash_rows(src, rowBytes, stride, rows);
+    bool dirty = !delta_valid || (delta_hash[block] != hash);
+
+    delta_hash[block] = hash;
+
+    return dirty;
+}
+
+static void delta_block_skip(short lineCount)
+{
+    delta_skipped += lineCount;
+}
+
+static void delta_block_send(uint16_t* line_buffer, short outputLine, short lineCount)
+{
+    if (delta_next_line != outputLine)
+    {
+        // Lines were skipped, move the controller's write window
+        send_reset_drawing(delta_left, delta_top + outputLine, delta_width, delta_height - outputLine);
+    }
+
+    send_continue_line(line_buffer, delta_width, lineCount);
+
+    delta_next_line = outputLine + lineCount;
+    delta_sent = true;
+}
+
+static void delta_frame_end()
+{
+    if (delta_sent)
+    {
+        send_continue_wait();
+    }
+
+    delta_valid = delta_enabled;
+    delta_skipped_last = delta_skipped;
+
+    stats_skipped_lines += delta_skipped;
+    ++stats_frames;
+}
+
+void odroid_display_direct_submit(short left, short top, short width, short height, const uint16_t* buffer)
+{
+    if (left < 0 || top < 0 || left + width > 320 || top + height > 240) abort();
+    if (width < 1 || height < 1) abort();
+
+    // Transfers are limited to the size of a line buffer
+    short rowsPerTransfer = (320 * line_count) / width;
+    if (rowsPerTransfer > height) rowsPerTransfer = height;
+
+    send_reset_drawing(left, top, width, height);
+
+    for (short y = 0; y < height; y += rowsPerTransfer)
+    {
+        short rows = (y + rowsPerTransfer > height) ? (height - y) : rowsPerTransfer;
+
+        spi_transaction_t* t;
+
+        t = spi_get_transaction();
+
+        t->tx_data[0] = 0x3C;   //memory write continue
+        t->length = 8;
+        t->user = (void*)0;
+        t->flags = SPI_TRANS_USE_TXDATA;
+
+        spi_put_transaction(t);
+
+
+        t = spi_get_transaction();
+
+        t->length = width * 2 * rows * 8;
+        t->tx_buffer = buffer + y * width;
+        t->user = (void*)0x41;  // data, not a line buffer
+        t->flags = 0;
+
+        spi_put_transaction(t);
+    }
+
+    direct_pending = true;
+    delta_invalidate();
+}
+
+void odroid_display_direct_fence()
+{
+    if (direct_pending)
+    {
+        send_continue_wait();
+    }
+}
+
+void odroid_display_pipeline_set(int lineBuffers, int lineCount)
+{
+    if (lineBuffers > LINE_BUFFERS_MAX) lineBuffers = LINE_BUFFERS_MAX;
+    if (lineBuffers > 0 && lineBuffers < LINE_BUFFERS_DEFAULT) lineBuffers = LINE_BUFFERS_DEFAULT;
+
+    if (lineCount < 1) lineCount = 1;
+    if (lineCount > 240) lineCount = 240;
+
+    line_buffers = lineBuffers;
+    line_count = lineCount;
+}
+
+void odroid_display_stats_get(odroid_display_stats* stats)
+{
+    // The totals are never reset, so counts made while this runs are
+    // reported next time instead of being lost
+    const uint32_t frames = stats_frames;
+    const uint32_t lineWaitMicros = stats_line_wait_micros;
+    const uint32_t spiWaitMicros = stats_spi_wait_micros;
+    const uint32_t depthSum = stats_depth_sum;
+    const uint32_t depthSamples = stats_depth_samples;
+    const uint32_t skippedLines = stats_skipped_lines;
+
+    // The maximum belongs to this period only once the display side
+    // restarted it
+    const uint32_t period = stats_period;
+    const uint32_t depthMax = (stats_depth_period == period) ? stats_depth_max : 0;
+    stats_period = period + 1;
+
+    stats->frames = frames - stats_reported.frames;
+    stats->lineWaitMicros = lineWaitMicros - stats_reported.lineWaitMicros;
+    stats->spiWaitMicros = spiWaitMicros - stats_reported.spiWaitMicros;
+    stats->skippedLines = skippedLines - stats_reported.skippedLines;
+
+    const uint32_t samples = depthSamples - stats_reported.depthSamples;
+    stats->depthAverage = samples ? (float)(depthSum - stats_reported.depthSum) / samples : 0;
+    stats->depthMax = depthMax;
+
+    stats_reported.frames = frames;
+    stats_reported.lineWaitMicros = lineWaitMicros;
+    stats_reported.spiWaitMicros = spiWaitMicros;
+    stats_reported.depthSum = depthSum;
+    stats_reported.depthSamples = depthSamples;
+    stats_reported.skippedLines = skippedLines;
+}
+
+void odroid_display_delta_mode_set(int value)
+{
+    delta_enabled = value ? true : false;
+    delta_valid = false;
+}
+
+int odroid_display_delta_skipped_lines_get()
+{
+    return delta_skipped_last;
+}
+
 static void backlight_init()
 {
     // Note: In esp-idf v3.0, settings flash speed to 80Mhz causes the LCD controller
@@ -507,221 +800,640 @@ static uint16_t Blend(uint16_t a, uint16_t b)
   return (rv << 11) | (gv << 5) | (bv);
 }
 
-void ili9341_write_frame_gb(uint16_t* buffer, int scale)
+// Blends two pairs of native RGB565 pixels at once. Produces the same
+// result as Blend() for each 16-bit half.
+static inline uint32_t Blend2(uint32_t a, uint32_t b)
 {
-    short x, y;
+    return (a & b) + (((a ^ b) & 0xF7DEF7DE) >> 1);
+}
 
-    odroid_display_lock_gb_display();
+#define SWAP_PIXEL(x) ((uint16_t)(((x) >> 8) | ((x) << 8)))
+#define SWAP_PIXEL2(x) ((((x) >> 8) & 0x00ff00ff) | (((x) << 8) & 0xff00ff00))
 
-    //xTaskToNotify = xTaskGetCurrentTaskHandle();
 
-    if (buffer == NULL)
+// Palette keyed blend table for the indexed formats. Entry [a * size + b]
+// holds the byte swapped midpoint of palette entries a and b, so the
+// diagonal holds the byte swapped palette itself. The table is allocated
+// on first use and rebuilt when the palette changes.
+#define BLEND_LUT_MAX_SIZE (64)
+
+typedef struct
+{
+    uint16_t* table;
+    uint16_t palette[BLEND_LUT_MAX_SIZE];
+    int size;
+    bool swapped;
+    bool valid;
+} blend_lut_t;
+
+static blend_lut_t blend_lut;
+
+// palette: native RGB565 if !swapped, otherwise already byte swapped
+static uint16_t* blend_lut_get(const uint16_t* palette, int size, bool swapped)
+{
+    blend_lut_t* lut = &blend_lut;
+
+    if (size < 1 || size > BLEND_LUT_MAX_SIZE) abort();
+
+    if (!lut->table)
     {
-        // clear the buffer
-        for (int i = 0; i < LINE_BUFFERS; ++i)
-        {
-            memset(line[i], 0, 320 * sizeof(uint16_t) * LINE_COUNT);
-        }
+        lut->table = heap_caps_malloc(BLEND_LUT_MAX_SIZE * BLEND_LUT_MAX_SIZE * sizeof(uint16_t), MALLOC_CAP_8BIT);
+        if (!lut->table) abort();
 
-        // clear the screen
-        send_reset_drawing(0, 0, 320, 240);
+        lut->valid = false;
+    }
 
-        for (y = 0; y < 240; y += LINE_COUNT)
-        {
-            uint16_t* line_buffer = line_buffer_get();
-            send_continue_line(line_buffer, 320, LINE_COUNT);
-        }
+    if (lut->valid && lut->size == size && lut->swapped == swapped &&
+        memcmp(lut->palette, palette, size * sizeof(uint16_t)) == 0)
+    {
+        return lut->table;
     }
-    else
+
+    memcpy(lut->palette, palette, size * sizeof(uint16_t));
+    lut->size = size;
+    lut->swapped = swapped;
+
+    for (int a = 0; a < size; ++a)
     {
-        uint16_t* framePtr = buffer;
+        uint16_t colorA = swapped ? SWAP_PIXEL(palette[a]) : palette[a];
 
-        if (scale)
+        for (int b = 0; b < size; ++b)
         {
-            // NOTE: LINE_COUNT must be 3 or greater
-            const short outputWidth = 265;
-            const short outputHeight = 240;
+            uint16_t colorB = swapped ? SWAP_PIXEL(palette[b]) : palette[b];
+            uint16_t mid = Blend(colorA, colorB);
 
-            send_reset_drawing(26, 0, outputWidth, outputHeight);
+            lut->table[a * size + b] = SWAP_PIXEL(mid);
+        }
+    }
 
-            for (y = 0; y < GAMEBOY_HEIGHT; y += 3)
-            {
-                uint16_t* line_buffer = line_buffer_get();
+    lut->valid = true;
 
-                for (int i = 0; i < 3; ++i)
-                {
-                    // skip middle vertical line
-                    int index = i * outputWidth * 2;
-                    int bufferIndex = ((y + i) * GAMEBOY_WIDTH);
-
-                    for (x = 0; x < GAMEBOY_WIDTH; x += 3)
-                    {
-                        uint16_t a = framePtr[bufferIndex++];
-                        uint16_t b;
-                        uint16_t c;
-
-                        if (x < GAMEBOY_WIDTH - 1)
-                        {
-                            b = framePtr[bufferIndex++];
-                            c = framePtr[bufferIndex++];
-                        }
-                        else
-                        {
-                            b = framePtr[bufferIndex++];
-                            c = 0;
-                        }
-
-                        uint16_t mid1 = Blend(a, b);
-                        uint16_t mid2 = Blend(b, c);
-
-                        line_buffer[index++] = ((a >> 8) | ((a) << 8));
-                        line_buffer[index++] = ((mid1 >> 8) | ((mid1) << 8));
-                        line_buffer[index++] = ((b >> 8) | ((b) << 8));
-                        line_buffer[index++] = ((mid2 >> 8) | ((mid2) << 8));
-                        line_buffer[index++] = ((c >> 8) | ((c ) << 8));
-                    }
-                }
+    return lut->table;
+}
 
-                // Blend top and bottom lines into middle
-                short sourceA = 0;
-                short sourceB = outputWidth * 2;
-                short sourceC = sourceB + (outputWidth * 2);
 
-                short output1 = outputWidth;
-                short output2 = output1 + (outputWidth * 2);
+// Scaler
+// Each output column and row maps to (source << 1) | blend, where blend
+// means the output is the midpoint of source and source + 1.
+#define SCALER_MAX_WIDTH (320)
+#define SCALER_MAX_HEIGHT (240)
 
-                for (short j = 0; j < outputWidth; ++j)
-                {
-                    uint16_t a = line_buffer[sourceA++];
-                    a = ((a >> 8) | ((a) << 8));
+static odroid_scaler scaler_current;
+static bool scaler_maps_valid;
+static bool scaler_columns_identity;
+static bool scaler_rows_blend;
+static uint16_t scaler_column_map[SCALER_MAX_WIDTH];
+static uint16_t scaler_row_map[SCALER_MAX_HEIGHT];
 
-                    uint16_t b = line_buffer[sourceB++];
-                    b = ((b >> 8) | ((b) << 8));
+// Scaled source rows kept for blending, slot = row & 1. Blending reads
+// them a pixel pair at a time, so both rows must be word aligned (an even
+// SCALER_MAX_WIDTH keeps the second one aligned).
+static uint16_t scaler_row_cache[2][SCALER_MAX_WIDTH] __attribute__((aligned(4)));
+static short scaler_row_cache_tag[2];
 
-                    uint16_t c = line_buffer[sourceC++];
-                    c = ((c >> 8) | ((c) << 8));
+static int scaler_gcd(int a, int b)
+{
+    while (b)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
 
-                    uint16_t mid = Blend(a, b);
-                    mid = ((mid >> 8) | ((mid) << 8));
+    return a;
+}
 
-                    line_buffer[output1++] = mid;
+// Splits both sizes into the smallest repeating groups and spreads each
+// group of sources evenly over its outputs. Outputs landing halfway
+// between two sources blend them; other positions round to the nearest
+// source (ties go to the source). 3:5 gives a ab b bc c and 4:5 gives
+// a b bc c d.
+static void scaler_map_build(uint16_t* map, int sourceSize, int outputSize)
+{
+    const int groupSize = scaler_gcd(sourceSize, outputSize);
+    const int sources = sourceSize / groupSize;
+    const int outputs = outputSize / groupSize;
 
-                    uint16_t mid2 = Blend(b, c);
-                    mid2 = ((mid2 >> 8) | ((mid2) << 8));
+    for (int i = 0; i < outputSize; ++i)
+    {
+        const int group = i / outputs;
+        const int step = i % outputs;
 
-                    line_buffer[output2++] = mid2;
-                }
+        // position in half source pixels
+        int half = 0;
 
-                // send the data
-                send_continue_line(line_buffer, outputWidth, 5);
-            }
-        }
-        else
+        if (sources > 1 && outputs > 1)
         {
-            send_reset_drawing((320 / 2) - (GAMEBOY_WIDTH / 2),
-                (240 / 2) - (GAMEBOY_HEIGHT / 2),
-                GAMEBOY_WIDTH,
-                GAMEBOY_HEIGHT);
+            const int num = 2 * step * (sources - 1);
+            const int den = outputs - 1;
+            const int rem = num % den;
 
-            for (y = 0; y < GAMEBOY_HEIGHT; y += LINE_COUNT)
-            {
-              uint16_t* line_buffer = line_buffer_get();
+            half = num / den;
+            if (rem * 2 > den || (rem * 2 == den && (half & 1))) ++half;
+        }
+
+        map[i] = ((group * sources + (half >> 1)) << 1) | (half & 1);
+    }
+}
+
+static void scaler_prepare(const odroid_scaler* scaler)
+{
+    if (scaler_maps_valid && memcmp(scaler, &scaler_current, sizeof(scaler_current)) == 0)
+        return;
+
+    if (scaler->outputWidth < 1 || scaler->outputWidth > SCALER_MAX_WIDTH ||
+        scaler->outputHeight < 1 || scaler->outputHeight > SCALER_MAX_HEIGHT ||
+        scaler->outputLeft < 0 || scaler->outputLeft + scaler->outputWidth > 320 ||
+        scaler->outputTop < 0 || scaler->outputTop + scaler->outputHeight > 240 ||
+        scaler->width < 1 || scaler->height < 1 ||
+        scaler->left < 0 || scaler->left + scaler->width > scaler->stride)
+    {
+        abort();
+    }
+
+    scaler_current = *scaler;
+
+    scaler_map_build(scaler_column_map, scaler->width, scaler->outputWidth);
+    scaler_map_build(scaler_row_map, scaler->height, scaler->outputHeight);
+
+    scaler_columns_identity = (scaler->width == scaler->outputWidth);
 
-              int linesWritten = 0;
+    scaler_rows_blend = false;
+    for (int i = 0; i < scaler->outputHeight; ++i)
+    {
+        if (scaler_row_map[i] & 1) scaler_rows_blend = true;
+    }
 
-              for (int i = 0; i < LINE_COUNT; ++i)
-              {
-                  if((y + i) >= GAMEBOY_HEIGHT) break;
+    scaler_maps_valid = true;
+}
 
-                  int index = (i) * GAMEBOY_WIDTH;
-                  int bufferIndex = ((y + i) * GAMEBOY_WIDTH);
+// Writes source row 'row' scaled to the output width, byte swapped.
+static void scaler_row_render(uint16_t* dst, const void* buffer, int row, const uint16_t* lut)
+{
+    const odroid_scaler* scaler = &scaler_current;
+    const short width = scaler->outputWidth;
+    const int offset = (scaler->top + row) * scaler->stride + scaler->left;
 
-                  for (x = 0; x < GAMEBOY_WIDTH; ++x)
-                  {
-                    uint16_t sample = framePtr[bufferIndex++];
-                    line_buffer[index++] = ((sample >> 8) | ((sample & 0xff) << 8));
-                  }
+    if (scaler->format == ODROID_PIXEL_FORMAT_INDEXED8)
+    {
+        const uint8_t* src = (const uint8_t*)buffer + offset;
+        const int size = scaler->paletteSize;
+        const uint8_t mask = size - 1;
 
-                  ++linesWritten;
-              }
+        if (scaler_columns_identity)
+        {
+            for (short x = 0; x < width; ++x)
+            {
+                dst[x] = lut[(src[x] & mask) * (size + 1)];
+            }
+        }
+        else
+        {
+            for (short x = 0; x < width; ++x)
+            {
+                const uint16_t map = scaler_column_map[x];
+                const uint8_t* sample = src + (map >> 1);
 
-              send_continue_line(line_buffer, GAMEBOY_WIDTH, linesWritten);
+                dst[x] = lut[(sample[0] & mask) * size + (sample[map & 1] & mask)];
             }
         }
     }
+    else
+    {
+        const uint16_t* src = (const uint16_t*)buffer + offset;
 
-    send_continue_wait();
+        if (scaler_columns_identity)
+        {
+            for (short x = 0; x < width; ++x)
+            {
+                dst[x] = SWAP_PIXEL(src[x]);
+            }
+        }
+        else
+        {
+            for (short x = 0; x < width; ++x)
+            {
+                const uint16_t map = scaler_column_map[x];
+                const uint16_t* sample = src + (map >> 1);
+                uint16_t mid = Blend2(sample[0], sample[map & 1]);
 
-    odroid_display_unlock_gb_display();
+                dst[x] = SWAP_PIXEL(mid);
+            }
+        }
+    }
 }
 
-void ili9341_init()
+static const uint16_t* scaler_row_get(const void* buffer, int row, const uint16_t* lut)
 {
-    // Init
-    spi_initialize();
+    const int slot = row & 1;
 
-
-    // Line buffers
-    const size_t lineSize = 320 * LINE_COUNT * sizeof(uint16_t);
-    for (int x = 0; x < LINE_BUFFERS; x++)
+    if (scaler_row_cache_tag[slot] != row)
     {
-        line[x] = heap_caps_malloc(lineSize, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
-        if (!line[x]) abort();
-
-        printf("%s: line_buffer_put(%p)\n", __func__, line[x]);
-        line_buffer_put(line[x]);
+        scaler_row_render(scaler_row_cache[slot], buffer, row, lut);
+        scaler_row_cache_tag[slot] = row;
     }
 
-    // Initialize transactions
-    for (int x = 0; x < SPI_TRANSACTION_COUNT; x++)
+    return scaler_row_cache[slot];
+}
+
+static void scaler_line_render(uint16_t* dst, const void* buffer, int outputLine, const uint16_t* lut)
+{
+    const short width = scaler_current.outputWidth;
+    const uint16_t map = scaler_row_map[outputLine];
+    const int row = map >> 1;
+
+    if (!scaler_rows_blend)
     {
-        void* param = &trans[x];
-        xQueueSend(spi_queue, &param, portMAX_DELAY);
+        scaler_row_render(dst, buffer, row, lut);
+    }
+    else if (!(map & 1))
+    {
+        memcpy(dst, scaler_row_get(buffer, row, lut), width * sizeof(uint16_t));
     }
+    else
+    {
+        const uint32_t* sourceA = (const uint32_t*)scaler_row_get(buffer, row, lut);
+        const uint32_t* sourceB = (const uint32_t*)scaler_row_get(buffer, row + 1, lut);
 
+        // dst is not word aligned for odd widths
+        for (short x = 0; x < width / 2; ++x)
+        {
+            uint32_t mid = Blend2(SWAP_PIXEL2(sourceA[x]), SWAP_PIXEL2(sourceB[x]));
+            mid = SWAP_PIXEL2(mid);
 
-    // Initialize SPI
-    esp_err_t ret;
-    //spi_device_handle_t spi;
-    spi_bus_config_t buscfg;
-		memset(&buscfg, 0, sizeof(buscfg));
+            *dst++ = mid;
+            *dst++ = mid >> 16;
+        }
 
-    buscfg.miso_io_num = SPI_PIN_NUM_MISO;
-    buscfg.mosi_io_num = SPI_PIN_NUM_MOSI;
-    buscfg.sclk_io_num = SPI_PIN_NUM_CLK;
-    buscfg.quadwp_io_num=-1;
-    buscfg.quadhd_io_num=-1;
+        if (width & 1)
+        {
+            const uint16_t a = ((const uint16_t*)sourceA)[width - 1];
+            const uint16_t b = ((const uint16_t*)sourceB)[width - 1];
 
-    spi_device_interface_config_t devcfg;
-		memset(&devcfg, 0, sizeof(devcfg));
+            *dst = SWAP_PIXEL(Blend(SWAP_PIXEL(a), SWAP_PIXEL(b)));
+        }
+    }
+}
 
-    devcfg.clock_speed_hz = LCD_SPI_CLOCK_RATE;
-    devcfg.mode = 0;                                //SPI mode 0
-    devcfg.spics_io_num = LCD_PIN_NUM_CS;               //CS pin
-    devcfg.queue_size = 7;                          //We want to be able to queue 7 transactions at a time
-    devcfg.pre_cb = ili_spi_pre_transfer_callback;  //Specify pre-transfer callback to handle D/C line
-    devcfg.flags = SPI_DEVICE_NO_DUMMY; //SPI_DEVICE_HALFDUPLEX;
+void odroid_display_write_frame(const odroid_scaler* scaler, const void* buffer, const uint16_t* palette)
+{
+    scaler_prepare(scaler);
 
-    //Initialize the SPI bus
-    ret=spi_bus_initialize(HSPI_HOST, &buscfg, 1);
-    assert(ret==ESP_OK);
+    const int bpp = (scaler->format == ODROID_PIXEL_FORMAT_INDEXED8) ? 1 : 2;
+    const uint16_t* lut = NULL;
 
-    //Attach the LCD to the SPI bus
-    ret=spi_bus_add_device(HSPI_HOST, &devcfg, &spi);
-    assert(ret==ESP_OK);
+    // Mode and palette changes force a full update
+    uint32_t key = delta_hash_rows((const uint8_t*)scaler, sizeof(*scaler), 0, 1);
 
+    if (scaler->format == ODROID_PIXEL_FORMAT_INDEXED8)
+    {
+        lut = blend_lut_get(palette, scaler->paletteSize, scaler->paletteSwapped);
+        key ^= delta_hash_rows((const uint8_t*)palette, scaler->paletteSize * sizeof(uint16_t), 0, 1);
+    }
 
+    scaler_row_cache_tag[0] = -1;
+    scaler_row_cache_tag[1] = -1;
 
+    const short outputHeight = scaler->outputHeight;
 
+    delta_frame_begin(key, scaler->outputLeft, scaler->outputTop, scaler->outputWidth, outputHeight);
 
-    //Initialize the LCD
-	printf("LCD: calling ili_init.\n");
-    ili_init();
+    for (short y = 0; y < outputHeight; y += line_count)
+    {
+        const short lineCount = (y + line_count > outputHeight) ? (outputHeight - y) : line_count;
 
-	printf("LCD: calling backlight_init.\n");
-    backlight_init();
+        // source rows feeding this block, from a word aligned start
+        const uint16_t firstMap = scaler_row_map[y];
+        const uint16_t lastMap = scaler_row_map[y + lineCount - 1];
+        const int firstRow = firstMap >> 1;
+        const int lastRow = (lastMap >> 1) + (lastMap & 1);
 
-    printf("LCD Initialized (%d Hz).\n", LCD_SPI_CLOCK_RATE);
+        const int offset = ((scaler->top + firstRow) * scaler->stride + scaler->left) * bpp;
+        const int alignedOffset = offset & ~3;
+
+        if (!delta_block_dirty(y / line_count, (const uint8_t*)buffer + alignedOffset,
+            scaler->width * bpp + (offset - alignedOffset), scaler->stride * bpp, lastRow - firstRow + 1))
+        {
+            delta_block_skip(lineCount);
+            continue;
+        }
+
+        uint16_t* line_buffer = line_buffer_get();
+
+        for (short i = 0; i < lineCount; ++i)
+        {
+            scaler_line_render(line_buffer + i * scaler->outputWidth, buffer, y + i, lut);
+        }
+
+        delta_block_send(line_buffer, y, lineCount);
+    }
+
+    delta_frame_end();
+}
+
+// Rectangles closer than this many wasted pixels are merged; a window
+// setup costs about as much as a line of pixels.
+#define RECT_MERGE_SLACK (320)
+
+static int rect_area(const odroid_rect* rect)
+{
+    return rect->width * rect->height;
+}
+
+static void rect_union(odroid_rect* result, const odroid_rect* a, const odroid_rect* b)
+{
+    short left = a->left < b->left ? a->left : b->left;
+    short top = a->top < b->top ? a->top : b->top;
+    short right = (a->left + a->width > b->left + b->width) ? a->left + a->width : b->left + b->width;
+    short bottom = (a->top + a->height > b->top + b->height) ? a->top + a->height : b->top + b->height;
+
+    result->left = left;
+    result->top = top;
+    result->width = right - left;
+    result->height = bottom - top;
+}
+
+int odroid_display_rects_coalesce(odroid_rect* rects, int count)
+{
+    // Drop empty rectangles
+    int n = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (rects[i].width > 0 && rects[i].height > 0) rects[n++] = rects[i];
+    }
+
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = i + 1; j < n; ++j)
+            {
+                odroid_rect both;
+                rect_union(&both, &rects[i], &rects[j]);
+
+                if (rect_area(&both) <= rect_area(&rects[i]) + rect_area(&rects[j]) + RECT_MERGE_SLACK)
+                {
+                    rects[i] = both;
+                    rects[j] = rects[--n];
+                    merged = true;
+                    --j;
+                }
+            }
+        }
+    }
+
+    return n;
+}
+
+// Converts a source rectangle to the output range [first, last] of a map
+static bool scaler_map_range(const uint16_t* map, int outputSize, int sourceStart, int sourceEnd, short* first, short* last)
+{
+    *first = -1;
+
+    for (short i = 0; i < outputSize; ++i)
+    {
+        const int start = map[i] >> 1;
+        const int end = start + (map[i] & 1);
+
+        if (end >= sourceStart && start < sourceEnd)
+        {
+            if (*first < 0) *first = i;
+            *last = i;
+        }
+    }
+
+    return *first >= 0;
+}
+
+static uint16_t scaler_line_temp[SCALER_MAX_WIDTH];
+
+void odroid_display_write_frame_rects(const odroid_scaler* scaler, const void* buffer, const uint16_t* palette,
+    const odroid_rect* rects, int count)
+{
+    if (count < 0 || count > ODROID_RECTS_MAX)
+    {
+        odroid_display_write_frame(scaler, buffer, palette);
+        return;
+    }
+
+    scaler_prepare(scaler);
+
+    const uint16_t* lut = NULL;
+    if (scaler->format == ODROID_PIXEL_FORMAT_INDEXED8)
+    {
+        lut = blend_lut_get(palette, scaler->paletteSize, scaler->paletteSwapped);
+    }
+
+    scaler_row_cache_tag[0] = -1;
+    scaler_row_cache_tag[1] = -1;
+
+    // Source rectangles to output rectangles (relative to the output origin)
+    odroid_rect outputRects[ODROID_RECTS_MAX];
+    int outputCount = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        const odroid_rect* rect = &rects[i];
+        short left, right, top, bottom;
+
+        if (!scaler_map_range(scaler_column_map, scaler->outputWidth,
+                rect->left - scaler->left, rect->left - scaler->left + rect->width, &left, &right) ||
+            !scaler_map_range(scaler_row_map, scaler->outputHeight,
+                rect->top - scaler->top, rect->top - scaler->top + rect->height, &top, &bottom))
+        {
+            continue;
+        }
+
+        odroid_rect* output = &outputRects[outputCount++];
+        output->left = left;
+        output->top = top;
+        output->width = right - left + 1;
+        output->height = bottom - top + 1;
+    }
+
+    outputCount = odroid_display_rects_coalesce(outputRects, outputCount);
+
+    for (int i = 0; i < outputCount; ++i)
+    {
+        const odroid_rect* rect = &outputRects[i];
+        const short rowsPerBuffer = (320 * line_count) / rect->width;
+
+        send_reset_drawing(scaler->outputLeft + rect->left, scaler->outputTop + rect->top, rect->width, rect->height);
+
+        for (short y = 0; y < rect->height; y += rowsPerBuffer)
+        {
+            const short rows = (y + rowsPerBuffer > rect->height) ? (rect->height - y) : rowsPerBuffer;
+            uint16_t* line_buffer = line_buffer_get();
+
+            for (short j = 0; j < rows; ++j)
+            {
+                scaler_line_render(scaler_line_temp, buffer, rect->top + y + j, lut);
+                memcpy(line_buffer + j * rect->width, scaler_line_temp + rect->left, rect->width * sizeof(uint16_t));
+            }
+
+            send_continue_line(line_buffer, rect->width, rows);
+        }
+    }
+
+    if (outputCount > 0)
+    {
+        send_continue_wait();
+    }
+
+    // Stored block hashes no longer match the screen
+    delta_invalidate();
+}
+
+static void write_frame_clear()
+{
+    // clear the buffer
+    for (int i = 0; i < line_buffers; ++i)
+    {
+        memset(line[i], 0, 320 * sizeof(uint16_t) * line_count);
+    }
+
+    // clear the screen
+    send_reset_drawing(0, 0, 320, 240);
+
+    for (short y = 0; y < 240; y += line_count)
+    {
+        uint16_t* line_buffer = line_buffer_get();
+        send_continue_line(line_buffer, 320, (y + line_count > 240) ? (240 - y) : line_count);
+    }
+
+    send_continue_wait();
+    delta_invalidate();
+}
+
+
+// GB: RGB565, the last column is dropped for an even 3:5 scale
+static const odroid_scaler gb_scaler =
+    { ODROID_PIXEL_FORMAT_565, GAMEBOY_WIDTH, 0, 0, GAMEBOY_WIDTH, GAMEBOY_HEIGHT, 0, 0,
+      (320 / 2) - (GAMEBOY_WIDTH / 2), (240 / 2) - (GAMEBOY_HEIGHT / 2), GAMEBOY_WIDTH, GAMEBOY_HEIGHT };
+static const odroid_scaler gb_scaler_scaled =
+    { ODROID_PIXEL_FORMAT_565, GAMEBOY_WIDTH, 0, 0, GAMEBOY_WIDTH - 1, GAMEBOY_HEIGHT, 0, 0,
+      26, 0, 265, 240 };
+
+// SMS / Game Gear: 5 bit indices into a native endian palette
+static const odroid_scaler sms_scaler =
+    { ODROID_PIXEL_FORMAT_INDEXED8, SMS_WIDTH, 0, 0, SMS_WIDTH, SMS_HEIGHT, SMS_PALETTE_SIZE, 0,
+      (320 / 2) - (SMS_WIDTH / 2), (240 / 2) - (SMS_HEIGHT / 2), SMS_WIDTH, SMS_HEIGHT };
+static const odroid_scaler sms_scaler_scaled =
+    { ODROID_PIXEL_FORMAT_INDEXED8, SMS_WIDTH, 0, 0, SMS_WIDTH, SMS_HEIGHT, SMS_PALETTE_SIZE, 0,
+      0, 0, 320, 240 };
+static const odroid_scaler gg_scaler =
+    { ODROID_PIXEL_FORMAT_INDEXED8, SMS_WIDTH, GAMEGEAR_LEFT, 0, GAMEGEAR_WIDTH, GAMEGEAR_HEIGHT, SMS_PALETTE_SIZE, 0,
+      (320 / 2) - (GAMEGEAR_WIDTH / 2), (240 / 2) - (GAMEGEAR_HEIGHT / 2), GAMEGEAR_WIDTH, GAMEGEAR_HEIGHT };
+static const odroid_scaler gg_scaler_scaled =
+    { ODROID_PIXEL_FORMAT_INDEXED8, SMS_WIDTH, GAMEGEAR_LEFT, 0, GAMEGEAR_WIDTH, GAMEGEAR_HEIGHT, SMS_PALETTE_SIZE, 0,
+      0, 0, 320, 240 };
+
+// NES: the palette is byte swapped and repeats every 64 entries (the upper
+// index bits are transparency and priority flags). Scaled crops 4 columns
+// each side for an even 4:5 scale.
+static const odroid_scaler nes_scaler =
+    { ODROID_PIXEL_FORMAT_INDEXED8, NES_GAME_WIDTH, 0, 0, NES_GAME_WIDTH, NES_GAME_HEIGHT, NES_PALETTE_SIZE, 1,
+      (320 / 2) - (NES_GAME_WIDTH / 2), (240 / 2) - (NES_GAME_HEIGHT / 2), NES_GAME_WIDTH, NES_GAME_HEIGHT };
+static const odroid_scaler nes_scaler_scaled =
+    { ODROID_PIXEL_FORMAT_INDEXED8, NES_GAME_WIDTH, 4, 0, NES_GAME_WIDTH - 8, NES_GAME_HEIGHT, NES_PALETTE_SIZE, 1,
+      5, (240 - NES_GAME_HEIGHT) / 2, 310, NES_GAME_HEIGHT };
+
+void ili9341_write_frame_gb(uint16_t* buffer, int scale)
+{
+    odroid_display_lock_gb_display();
+
+    if (buffer == NULL)
+    {
+        write_frame_clear();
+    }
+    else
+    {
+        odroid_display_write_frame(scale ? &gb_scaler_scaled : &gb_scaler, buffer, NULL);
+    }
+
+    odroid_display_unlock_gb_display();
+}
+
+void ili9341_init()
+{
+    // Line buffers
+    const size_t lineSize = 320 * line_count * sizeof(uint16_t);
+
+    if (line_buffers <= 0)
+    {
+        // Use up to an eighth of the free DMA capable memory
+        line_buffers = heap_caps_get_free_size(MALLOC_CAP_DMA) / 8 / lineSize;
+        if (line_buffers < LINE_BUFFERS_DEFAULT) line_buffers = LINE_BUFFERS_DEFAULT;
+        if (line_buffers > LINE_BUFFERS_MAX) line_buffers = LINE_BUFFERS_MAX;
+    }
+
+    printf("%s: line_buffers=%d, line_count=%d\n", __func__, line_buffers, line_count);
+
+    spi_initialize();
+
+    for (int x = 0; x < line_buffers; x++)
+    {
+        line[x] = heap_caps_malloc(lineSize, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+        if (!line[x]) abort();
+
+        printf("%s: line_buffer_put(%p)\n", __func__, line[x]);
+        line_buffer_put(line[x]);
+    }
+
+    // Initialize transactions
+    for (int x = 0; x < spi_transaction_count; x++)
+    {
+        void* param = &trans[x];
+        xQueueSend(spi_queue, &param, portMAX_DELAY);
+    }
+
+
+    // Initialize SPI
+    esp_err_t ret;
+    //spi_device_handle_t spi;
+    spi_bus_config_t buscfg;
+		memset(&buscfg, 0, sizeof(buscfg));
+
+    buscfg.miso_io_num = SPI_PIN_NUM_MISO;
+    buscfg.mosi_io_num = SPI_PIN_NUM_MOSI;
+    buscfg.sclk_io_num = SPI_PIN_NUM_CLK;
+    buscfg.quadwp_io_num=-1;
+    buscfg.quadhd_io_num=-1;
+    buscfg.max_transfer_sz = lineSize;
+
+    spi_device_interface_config_t devcfg;
+		memset(&devcfg, 0, sizeof(devcfg));
+
+    devcfg.clock_speed_hz = LCD_SPI_CLOCK_RATE;
+    devcfg.mode = 0;                                //SPI mode 0
+    devcfg.spics_io_num = LCD_PIN_NUM_CS;               //CS pin
+    devcfg.queue_size = spi_transaction_count + 3;  //Every transaction plus commands
+    devcfg.pre_cb = ili_spi_pre_transfer_callback;  //Specify pre-transfer callback to handle D/C line
+    devcfg.flags = SPI_DEVICE_NO_DUMMY; //SPI_DEVICE_HALFDUPLEX;
+
+    //Initialize the SPI bus
+    ret=spi_bus_initialize(HSPI_HOST, &buscfg, 1);
+    assert(ret==ESP_OK);
+
+    //Attach the LCD to the SPI bus
+    ret=spi_bus_add_device(HSPI_HOST, &devcfg, &spi);
+    assert(ret==ESP_OK);
+
+
+
+
+
+    //Initialize the LCD
+	printf("LCD: calling ili_init.\n");
+    ili_init();
+
+	printf("LCD: calling backlight_init.\n");
+    backlight_init();
+
+    printf("LCD Initialized (%d Hz).\n", LCD_SPI_CLOCK_RATE);
 }
 
 void ili9341_poweroff()
@@ -809,389 +1521,46 @@ void ili9341_prepare()
 //
 void ili9341_write_frame_sms(uint8_t* buffer, uint16_t color[], uint8_t isGameGear, uint8_t scale)
 {
-    short x, y;
-
     odroid_display_lock_sms_display();
 
     if (buffer == NULL)
     {
-        // clear the buffer
-        for (int i = 0; i < LINE_BUFFERS; ++i)
-        {
-            memset(line[i], 0, 320 * sizeof(uint16_t) * LINE_COUNT);
-        }
-
-        // clear the screen
-        send_reset_drawing(0, 0, 320, 240);
-
-        for (y = 0; y < 240; y += LINE_COUNT)
-        {
-            uint16_t* line_buffer = line_buffer_get();
-            send_continue_line(line_buffer, 320, LINE_COUNT);
-        }
+        write_frame_clear();
     }
     else
     {
-        uint8_t* framePtr = buffer;
-
-
-        if (!isGameGear)
-        {
-            if (scale)
-            {
-                // const short xOffset = 4;
-                // const uint16_t displayWidth = 320 - (xOffset / 4 * 5);
-                // const short centerX = (320 - displayWidth) >> 1;
-
-                //send_reset_drawing(centerX, 0, displayWidth, 240);
-
-                const uint16_t displayWidth = 320;
-                send_reset_drawing(0, 0, 320, 240);
-
-                for (y = 0; y < SMS_HEIGHT; y += 4)
-                {
-                  int linesWritten = 0;
-                  uint16_t* line_buffer = line_buffer_get();
+        const odroid_scaler* scaler = isGameGear ?
+            (scale ? &gg_scaler_scaled : &gg_scaler) :
+            (scale ? &sms_scaler_scaled : &sms_scaler);
 
-                  for (short i = 0; i < 4; ++i)
-                  {
-                      if((y + i) >= SMS_HEIGHT)
-                        break;
-
-                      int index = (i) * displayWidth;
-                      if (i > 1) index += displayWidth; // skip a line for blending
-
-                      //int bufferIndex = ((y + i) * SMS_WIDTH) + xOffset;
-                      int bufferIndex = ((y + i) * SMS_WIDTH);
-
-                      uint16_t samples[4];
-
-                      //for (x = 0; x < SMS_WIDTH - (xOffset * 2); x += 4)
-                      for (x = 0; x < SMS_WIDTH; x += 4)
-                      {
-                        for (short j = 0; j < 4; ++j)
-                        {
-                            uint8_t val = framePtr[bufferIndex++] & PIXEL_MASK;
-                            //
-                            // uint8_t r = color[val][0];
-                            // uint8_t g = color[val][1];
-                            // uint8_t b = color[val][2];
-                            //
-                            // samples[j] = (((r << 8) & 0xF800) | ((g << 3) & 0x07E0) | ((b >> 3) & 0x001F));
-
-                            samples[j] = color[val];
-                        }
-
-                        uint16_t mid1 = Blend(samples[1], samples[2]);
-
-                        line_buffer[index++] = ((samples[0] >> 8) | (samples[0] << 8));
-                        line_buffer[index++] = ((samples[1] >> 8) | (samples[1] << 8));
-                        line_buffer[index++] = ((mid1 >> 8) | (mid1 << 8));
-                        line_buffer[index++] = ((samples[2] >> 8) | (samples[2] << 8));
-                        line_buffer[index++] = ((samples[3] >> 8) | (samples[3] << 8));
-                      }
-
-                      ++linesWritten;
-                  }
-
-                  // blend horizontal
-                  short srcIndex1 = displayWidth * 1;
-                  short srcIndex2 = displayWidth * 3;
-                  short dstIndex = displayWidth * 2;
-
-                  for (short i = 0; i < displayWidth; ++i)
-                  {
-                      uint16_t sample1 = line_buffer[srcIndex1++];
-                      sample1 = ((sample1 >> 8) | (sample1 << 8));
-
-                      uint16_t sample2 = line_buffer[srcIndex2++];
-                      sample2 = ((sample2 >> 8) | (sample2 << 8));
-
-                      uint16_t mid1 = Blend(sample1, sample2);
-
-                      line_buffer[dstIndex++] = ((mid1 >> 8) | (mid1 << 8));
-                  }
-
-                  ++linesWritten;
-
-                  // display
-                  send_continue_line(line_buffer, displayWidth, linesWritten);
-                }
-            }
-            else
-            {
-                send_reset_drawing((320 / 2) - (SMS_WIDTH / 2),
-                    (240 / 2) - (SMS_HEIGHT / 2),
-                    SMS_WIDTH,
-                    SMS_HEIGHT);
-
-                for (y = 0; y < SMS_HEIGHT; y += LINE_COUNT)
-                {
-                  int linesWritten = 0;
-                  uint16_t* line_buffer = line_buffer_get();
-
-                  for (short i = 0; i < LINE_COUNT; ++i)
-                  {
-                      if((y + i) >= SMS_HEIGHT)
-                        break;
-
-                      int index = (i) * SMS_WIDTH;
-                      int bufferIndex = ((y + i) * SMS_WIDTH);
-
-                      for (x = 0; x < SMS_WIDTH; ++x)
-                      {
-                        // uint8_t val = framePtr[bufferIndex++] & PIXEL_MASK;
-                        //
-                        // uint8_t r = color[val][0];
-                        // uint8_t g = color[val][1];
-                        // uint8_t b = color[val][2];
-                        //
-                        // uint16_t sample = (((r << 8) & 0xF800) | ((g << 3) & 0x07E0) | ((b >> 3) & 0x001F));
-
-                        uint16_t sample = color[framePtr[bufferIndex++] & PIXEL_MASK];
-                        line_buffer[index++] = ((sample >> 8) | (sample << 8));
-                      }
-
-                      ++linesWritten;
-                  }
-
-                  // display
-                  send_continue_line(line_buffer, SMS_WIDTH, linesWritten);
-                }
-            }
-        }
-        else
-        {
-            // game Gear
-            //framePtr += (24 * 256);
-
-            if (scale)
-            {
-                const short outputWidth = 320;
-                const short outputHeight = 240;
-
-                send_reset_drawing(0, 0, outputWidth, outputHeight);
-
-                for (y = 0; y < 144; y += 3)
-                {
-                    uint16_t* line_buffer = line_buffer_get();
-
-                    for (short i = 0; i < 3; ++i)
-                    {
-                        // skip middle vertical line
-                        int index = i * outputWidth * 2;
-                        int bufferIndex = ((y + i) * 256) + 48;
-
-                        for (x = 0; x < GAMEGEAR_WIDTH; ++x)
-                        {
-                            uint8_t val = framePtr[bufferIndex++] & PIXEL_MASK;
-
-                            // uint8_t r = color[val][0];
-                            // uint8_t g = color[val][1];
-                            // uint8_t b = color[val][2];
-                            //
-                            // uint16_t sample = (((r << 8) & 0xF800) | ((g << 3) & 0x07E0) | ((b >> 3) & 0x001F));
-
-                            uint16_t sample = color[val];
-                            sample = (sample >> 8) | (sample << 8);
-
-                            line_buffer[index++] = sample;
-                            line_buffer[index++] = sample;
-                        }
-                    }
-
-                    // Blend top and bottom lines into middle
-                    short sourceA = 0;
-                    short sourceB = outputWidth * 2;
-                    short sourceC = sourceB + (outputWidth * 2);
-
-                    short output1 = outputWidth;
-                    short output2 = output1 + (outputWidth * 2);
-
-                    for (short j = 0; j < outputWidth; ++j)
-                    {
-                      uint16_t a = line_buffer[sourceA++];
-                      a = ((a >> 8) | ((a) << 8));
-
-                      uint16_t b = line_buffer[sourceB++];
-                      b = ((b >> 8) | ((b) << 8));
-
-                      uint16_t c = line_buffer[sourceC++];
-                      c = ((c >> 8) | ((c) << 8));
-
-                      uint16_t mid = Blend(a, b);
-                      mid = ((mid >> 8) | ((mid) << 8));
-
-                      line_buffer[output1++] = mid;
-
-                      uint16_t mid2 = Blend(b, c);
-                      mid2 = ((mid2 >> 8) | ((mid2) << 8));
-
-                      line_buffer[output2++] = mid2;
-                    }
-
-                    // send the data
-                    send_continue_line(line_buffer, outputWidth, 5);
-                }
-            }
-            else
-            {
-                send_reset_drawing((320 / 2) - (GAMEGEAR_WIDTH / 2),
-                    (240 / 2) - (GAMEGEAR_HEIGHT / 2),
-                    GAMEGEAR_WIDTH,
-                    GAMEGEAR_HEIGHT);
-
-                for (y = 0; y < GAMEGEAR_HEIGHT; y += LINE_COUNT)
-                {
-                  int linesWritten = 0;
-                  uint16_t* line_buffer = line_buffer_get();
-
-                  for (short i = 0; i < LINE_COUNT; ++i)
-                  {
-                      if((y + i) >= GAMEGEAR_HEIGHT)
-                        break;
-
-                      int index = (i) * GAMEGEAR_WIDTH;
-                      int bufferIndex = ((y + i) * 256) + 48;
-
-                      for (x = 0; x < GAMEGEAR_WIDTH; ++x)
-                      {
-                        uint8_t val = framePtr[bufferIndex++] & PIXEL_MASK;
-
-                        // uint8_t r = color[val][0];
-                        // uint8_t g = color[val][1];
-                        // uint8_t b = color[val][2];
-                        //
-                        // uint16_t sample = (((r << 8) & 0xF800) | ((g << 3) & 0x07E0) | ((b >> 3) & 0x001F));
-
-                        uint16_t sample = color[val];
-                        line_buffer[index++] = ((sample >> 8) | (sample << 8));
-                      }
-
-                      ++linesWritten;
-                  }
-
-                  // display
-                  send_continue_line(line_buffer, GAMEGEAR_WIDTH, linesWritten);
-                }
-            }
-        }
+        odroid_display_write_frame(scaler, buffer, color);
     }
 
-    send_continue_wait();
     odroid_display_unlock_sms_display();
 }
 
-//
+void ili9341_write_frame_nes_rects(uint8_t* buffer, uint16_t* myPalette, uint8_t scale, const odroid_rect* rects, int count)
+{
+    odroid_display_lock_nes_display();
+
+    odroid_display_write_frame_rects(scale ? &nes_scaler_scaled : &nes_scaler, buffer, myPalette, rects, count);
+
+    odroid_display_unlock_nes_display();
+}
 
 void ili9341_write_frame_nes(uint8_t* buffer, uint16_t* myPalette, uint8_t scale)
 {
-    short x, y;
-
     odroid_display_lock_nes_display();
 
-    //xTaskToNotify = xTaskGetCurrentTaskHandle();
-
     if (buffer == NULL)
     {
-        // clear the buffer
-        for (int i = 0; i < LINE_BUFFERS; ++i)
-        {
-            memset(line[i], 0, 320 * sizeof(uint16_t) * LINE_COUNT);
-        }
-
-        // clear the screen
-        send_reset_drawing(0, 0, 320, 240);
-
-        for (y = 0; y < 240; y += LINE_COUNT)
-        {
-            uint16_t* line_buffer = line_buffer_get();
-            send_continue_line(line_buffer, 320, LINE_COUNT);
-        }
+        write_frame_clear();
     }
     else
     {
-        uint8_t* framePtr = buffer;
-
-        if (scale)
-        {
-            const uint16_t displayWidth = 320 - 10;
-            const uint16_t top = (240 - NES_GAME_HEIGHT) / 2;
-
-            send_reset_drawing((320 / 2) - (displayWidth / 2), top, displayWidth, NES_GAME_HEIGHT);
-
-            for (y = 0; y < NES_GAME_HEIGHT; y += LINE_COUNT)
-            {
-              int linesWritten = 0;
-              uint16_t* line_buffer = line_buffer_get();
-
-              for (short i = 0; i < LINE_COUNT; ++i)
-              {
-                  if((y + i) >= NES_GAME_HEIGHT)
-                    break;
-
-                  int index = (i) * displayWidth;
-
-                  int bufferIndex = ((y + i) * NES_GAME_WIDTH) + 4;
-
-                  uint16_t samples[4];
-                  for (x = 4; x < NES_GAME_WIDTH - 4; x += 4)
-                  {
-                    for (short j = 0; j < 4; ++j)
-                    {
-                        uint8_t val = framePtr[bufferIndex++];
-                        samples[j] = myPalette[val];
-                    }
-
-                    uint16_t mid = Blend(samples[1] >> 8 | samples[1] << 8, samples[2] >> 8 | samples[2] << 8);
-
-                    line_buffer[index++] = samples[0];
-                    line_buffer[index++] = samples[1];
-                    line_buffer[index++] = mid >> 8 | mid << 8;
-                    line_buffer[index++] = samples[2];
-                    line_buffer[index++] = samples[3];
-                  }
-
-                  ++linesWritten;
-              }
-
-              // display
-              send_continue_line(line_buffer, displayWidth, linesWritten);
-            }
-        }
-        else
-        {
-            send_reset_drawing((320 / 2) - (NES_GAME_WIDTH / 2), (240 / 2) - (NES_GAME_HEIGHT / 2), NES_GAME_WIDTH, NES_GAME_HEIGHT);
-
-            for (y = 0; y < NES_GAME_HEIGHT; y += LINE_COUNT)
-            {
-              int linesWritten = 0;
-              uint16_t* line_buffer = line_buffer_get();
-
-              for (short i = 0; i < LINE_COUNT; ++i)
-              {
-                  if((y + i) >= NES_GAME_HEIGHT)
-                    break;
-
-                  int index = (i) * NES_GAME_WIDTH;
-                  int bufferIndex = ((y + i) * NES_GAME_WIDTH);
-
-                  for (x = 0; x < NES_GAME_WIDTH; ++x)
-                  {
-                    line_buffer[index++] = myPalette[framePtr[bufferIndex++]];
-                  }
-
-                  ++linesWritten;
-              }
-
-              // display
-              send_continue_line(line_buffer, NES_GAME_WIDTH, linesWritten);
-            }
-        }
+        odroid_display_write_frame(scale ? &nes_scaler_scaled : &nes_scaler, buffer, myPalette);
     }
 
-    send_continue_wait();
-
     odroid_display_unlock_nes_display();
 }
 
@@ -1233,121 +1602,129 @@ void ili9341_write_frame_nes(uint8_t* buffer, uint16_t* myPalette, uint8_t scale
 //     }
 // }
 
-void ili9341_write_frame_rectangle(short left, short top, short width, short height, uint16_t* buffer)
+// Sends the part of an image covered by rect. The image is width x height
+// pixels placed at left, top on screen.
+static void send_image_rect(short left, short top, short width, short height, const uint16_t* buffer,
+    uint8_t swapBytes, const odroid_rect* rect)
 {
-    short x, y;
+    // Clip to the image
+    short x0 = rect->left > left ? rect->left : left;
+    short y0 = rect->top > top ? rect->top : top;
+    short x1 = (rect->left + rect->width < left + width) ? rect->left + rect->width : left + width;
+    short y1 = (rect->top + rect->height < top + height) ? rect->top + rect->height : top + height;
 
-    if (left < 0 || top < 0) abort();
-    if (width < 1 || height < 1) abort();
+    if (x1 <= x0 || y1 <= y0) return;
 
-    //xTaskToNotify = xTaskGetCurrentTaskHandle();
-
-    send_reset_drawing(left, top, width, height);
-
-    if (buffer == NULL)
-    {
-        // clear the buffer
-        for (int i = 0; i < LINE_BUFFERS; ++i)
-        {
-            memset(line[i], 0, 320 * sizeof(uint16_t) * LINE_COUNT);
-        }
+    const short rectWidth = x1 - x0;
+    const short rectHeight = y1 - y0;
+    const short rowsPerBuffer = (320 * line_count) / rectWidth;
 
-        // clear the screen
-        send_reset_drawing(0, 0, 320, 240);
+    send_reset_drawing(x0, y0, rectWidth, rectHeight);
 
-        for (y = 0; y < 240; y += LINE_COUNT)
-        {
-            uint16_t* line_buffer = line_buffer_get();
-            send_continue_line(line_buffer, 320, LINE_COUNT);
-        }
-    }
-    else
+    for (short y = 0; y < rectHeight; y += rowsPerBuffer)
     {
+        const short rows = (y + rowsPerBuffer > rectHeight) ? (rectHeight - y) : rowsPerBuffer;
         uint16_t* line_buffer = line_buffer_get();
 
-        for (y = 0; y < height; y++)
+        for (short i = 0; i < rows; ++i)
         {
-            memcpy(line_buffer, buffer + y * width, width * sizeof(uint16_t));
-            send_continue_line(line_buffer, width, 1);
+            const uint16_t* src = buffer + (y0 - top + y + i) * width + (x0 - left);
+            uint16_t* dst = line_buffer + i * rectWidth;
+
+            if (swapBytes)
+            {
+                for (short x = 0; x < rectWidth; ++x)
+                {
+                    dst[x] = SWAP_PIXEL(src[x]);
+                }
+            }
+            else
+            {
+                memcpy(dst, src, rectWidth * sizeof(uint16_t));
+            }
         }
-    }
 
-    send_continue_wait();
+        send_continue_line(line_buffer, rectWidth, rows);
+    }
 }
 
-void ili9341_clear(uint16_t color)
+void odroid_display_write_image_rects(short left, short top, short width, short height, const uint16_t* buffer,
+    uint8_t swapBytes, const odroid_rect* rects, int count)
 {
-    //xTaskToNotify = xTaskGetCurrentTaskHandle();
+    if (left < 0 || top < 0 || left + width > 320 || top + height > 240) abort();
+    if (width < 1 || height < 1) abort();
+    if (count < 0 || count > ODROID_RECTS_MAX) abort();
 
-    send_reset_drawing(0, 0, 320, 240);
+    odroid_rect merged[ODROID_RECTS_MAX];
+    memcpy(merged, rects, count * sizeof(odroid_rect));
 
+    count = odroid_display_rects_coalesce(merged, count);
 
-    // clear the buffer
-    for (int i = 0; i < LINE_BUFFERS; ++i)
+    for (int i = 0; i < count; ++i)
     {
-        for (int j = 0; j < 320 * LINE_COUNT; ++j)
-        {
-            line[i][j] = color;
-        }
+        send_image_rect(left, top, width, height, buffer, swapBytes, &merged[i]);
     }
 
-    // clear the screen
-    send_reset_drawing(0, 0, 320, 240);
-
-    for (int y = 0; y < 240; y += LINE_COUNT)
+    if (count > 0)
     {
-        uint16_t* line_buffer = line_buffer_get();
-        send_continue_line(line_buffer, 320, LINE_COUNT);
+        send_continue_wait();
     }
 
-    send_continue_wait();
+    delta_invalidate();
 }
 
-void ili9341_write_frame_rectangleLE(short left, short top, short width, short height, uint16_t* buffer)
+static void write_frame_rectangle(short left, short top, short width, short height, uint16_t* buffer, uint8_t swapBytes)
 {
-    short x, y;
-
     if (left < 0 || top < 0) abort();
     if (width < 1 || height < 1) abort();
 
     //xTaskToNotify = xTaskGetCurrentTaskHandle();
 
-    send_reset_drawing(left, top, width, height);
-
     if (buffer == NULL)
     {
-        // clear the buffer
-        for (int i = 0; i < LINE_BUFFERS; ++i)
-        {
-            memset(line[i], 0, 320 * sizeof(uint16_t) * LINE_COUNT);
-        }
+        write_frame_clear();
+    }
+    else
+    {
+        const odroid_rect rect = { left, top, width, height };
+        odroid_display_write_image_rects(left, top, width, height, buffer, swapBytes, &rect, 1);
+    }
+}
+
+void ili9341_write_frame_rectangle(short left, short top, short width, short height, uint16_t* buffer)
+{
+    write_frame_rectangle(left, top, width, height, buffer, 0);
+}
 
-        // clear the screen
-        send_reset_drawing(0, 0, 320, 240);
+void ili9341_clear(uint16_t color)
+{
+    //xTaskToNotify = xTaskGetCurrentTaskHandle();
 
-        for (y = 0; y < 240; y += LINE_COUNT)
+    // clear the buffer
+    for (int i = 0; i < line_buffers; ++i)
+    {
+        for (int j = 0; j < 320 * line_count; ++j)
         {
-            uint16_t* line_buffer = line_buffer_get();
-            send_continue_line(line_buffer, 320, LINE_COUNT);
+            line[i][j] = color;
         }
     }
-    else
-    {
-        for (y = 0; y < height; y++)
-        {
-            uint16_t* line_buffer = line_buffer_get();
 
-            for (int i = 0; i < width; ++i)
-            {
-                uint16_t pixel = buffer[y * width + i];
-                line_buffer[i] = pixel << 8 | pixel >> 8;
-            }
+    // clear the screen
+    send_reset_drawing(0, 0, 320, 240);
 
-            send_continue_line(line_buffer, width, 1);
-        }
+    for (int y = 0; y < 240; y += line_count)
+    {
+        uint16_t* line_buffer = line_buffer_get();
+        send_continue_line(line_buffer, 320, (y + line_count > 240) ? (240 - y) : line_count);
     }
 
     send_continue_wait();
+    delta_invalidate();
+}
+
+void ili9341_write_frame_rectangleLE(short left, short top, short width, short height, uint16_t* buffer)
+{
+    write_frame_rectangle(left, top, width, height, buffer, 1);
 }
 
 void display_tasktonotify_set(int value)
@@ -7,6 +7,57 @@ enum ODROID_SD_ERR {
     ODROID_SD_ERR_NOCARD = 0x02
 };
 
+typedef enum
+{
+    ODROID_PIXEL_FORMAT_565 = 0,    // native endian RGB565
+    ODROID_PIXEL_FORMAT_INDEXED8    // 8 bit palette indices
+} ODROID_PIXEL_FORMAT;
+
+// Describes how a source frame is placed on screen. The source rectangle
+// is scaled to the output rectangle; positions between two source pixels
+// (or lines) are blended.
+typedef struct
+{
+    ODROID_PIXEL_FORMAT format;
+    short stride;           // source pixels per line
+    short left;             // source rectangle
+    short top;
+    short width;
+    short height;
+    short paletteSize;      // INDEXED8: entries used (power of 2, max 64), indices are masked
+    short paletteSwapped;   // INDEXED8: palette is already byte swapped
+    short outputLeft;       // screen rectangle
+    short outputTop;
+    short outputWidth;
+    short outputHeight;
+} odroid_scaler;
+
+void odroid_display_write_frame(const odroid_scaler* scaler, const void* buffer, const uint16_t* palette);
+
+// Partial updates. Each rectangle gets its own controller window.
+#define ODROID_RECTS_MAX (32)
+
+typedef struct
+{
+    short left;
+    short top;
+    short width;
+    short height;
+} odroid_rect;
+
+// Merges overlapping and nearby rectangles in place, returns the new count
+int odroid_display_rects_coalesce(odroid_rect* rects, int count);
+
+// Sends only the output covering the given source rectangles. count < 0
+// sends the whole frame.
+void odroid_display_write_frame_rects(const odroid_scaler* scaler, const void* buffer, const uint16_t* palette,
+    const odroid_rect* rects, int count);
+
+// Sends the parts of an RGB565 image covered by the screen rectangles. The
+// image is width x height pixels placed at left, top.
+void odroid_display_write_image_rects(short left, short top, short width, short height, const uint16_t* buffer,
+    uint8_t swapBytes, const odroid_rect* rects, int count);
+
 void ili9341_write_frame_gb(uint16_t* buffer, int scale);
 void ili9341_init();
 void ili9341_poweroff();
@@ -17,6 +68,7 @@ void send_continue_line(uint16_t *line, int width, int lineCount);
 
 void ili9341_write_frame_sms(uint8_t* buffer, uint16_t color[], uint8_t isGameGear, uint8_t scale);
 void ili9341_write_frame_nes(uint8_t* buffer, uint16_t* myPalette, uint8_t scale);
+void ili9341_write_frame_nes_rects(uint8_t* buffer, uint16_t* myPalette, uint8_t scale, const odroid_rect* rects, int count);
 
 void backlight_percentage_set(int value);
 //void ili9341_write_frame(uint16_t* buffer);
@@ -36,3 +88,30 @@ void odroid_display_lock_nes_display();
 void odroid_display_unlock_nes_display();
 void odroid_display_lock_sms_display();
 void odroid_display_unlock_sms_display();
+
+// Zero-copy frame submission. The pixels are sent straight from buffer,
+// which must be DMA capable and hold width * height big endian RGB565
+// pixels. The buffer must not be modified until odroid_display_direct_fence
+// returns.
+void odroid_display_direct_submit(short left, short top, short width, short height, const uint16_t* buffer);
+void odroid_display_direct_fence();
+
+// Must be called before ili9341_init. lineBuffers <= 0 sizes the pool from
+// free DMA memory.
+void odroid_display_pipeline_set(int lineBuffers, int lineCount);
+
+typedef struct
+{
+    uint32_t frames;
+    uint32_t lineWaitMicros;    // blocked waiting for a free line buffer
+    uint32_t spiWaitMicros;     // blocked waiting for the SPI queue to drain
+    float depthAverage;         // line buffers in flight when one is requested
+    uint32_t depthMax;
+    uint32_t skippedLines;
+} odroid_display_stats;
+
+// Returns the totals since the previous call. Call from one task only.
+void odroid_display_stats_get(odroid_display_stats* stats);
+
+void odroid_display_delta_mode_set(int value);
+int odroid_display_delta_skipped_lines_get();
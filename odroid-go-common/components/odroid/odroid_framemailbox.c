@@ -0,0 +1,118 @@
+#include "odroid_framemailbox.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define SLOT_MASK (0x03)
+#define BACK_SHIFT (0)
+#define READY_SHIFT (2)
+#define FRONT_SHIFT (4)
+#define STATE_FRESH (0x40)
+
+#define STATE_SLOT(state, shift) (((state) >> (shift)) & SLOT_MASK)
+#define STATE_MAKE(back, ready, front) \
+    (((back) << BACK_SHIFT) | ((ready) << READY_SHIFT) | ((front) << FRONT_SHIFT))
+
+
+static bool state_exchange(odroid_framemailbox* mailbox, uint32_t expected, uint32_t value)
+{
+    uint32_t set = value;
+    uxPortCompareSet(&mailbox->state, expected, &set);
+
+    return set == expected;
+}
+
+void odroid_framemailbox_init(odroid_framemailbox* mailbox, void* buffer0, void* buffer1, void* buffer2)
+{
+    if (!buffer0 || !buffer1 || !buffer2) abort();
+
+    memset(mailbox, 0, sizeof(*mailbox));
+
+    mailbox->buffers[0] = buffer0;
+    mailbox->buffers[1] = buffer1;
+    mailbox->buffers[2] = buffer2;
+
+    mailbox->state = STATE_MAKE(0, 1, 2);
+
+    mailbox->published = xSemaphoreCreateBinary();
+    if (!mailbox->published) abort();
+}
+
+int odroid_framemailbox_back_get(odroid_framemailbox* mailbox)
+{
+    return STATE_SLOT(mailbox->state, BACK_SHIFT);
+}
+
+int odroid_framemailbox_publish(odroid_framemailbox* mailbox)
+{
+    uint32_t state;
+    uint32_t next;
+
+    // Only the producer moves the back slot, so it is stable here
+    mailbox->sequence[STATE_SLOT(mailbox->state, BACK_SHIFT)] = ++mailbox->publishCount;
+
+    do
+    {
+        state = mailbox->state;
+        next = STATE_MAKE(STATE_SLOT(state, READY_SHIFT),
+                          STATE_SLOT(state, BACK_SHIFT),
+                          STATE_SLOT(state, FRONT_SHIFT)) | STATE_FRESH;
+    } while (!state_exchange(mailbox, state, next));
+
+    if (state & STATE_FRESH)
+        ++mailbox->framesDropped;
+
+    // Never blocks: a pending give already wakes the consumer
+    xSemaphoreGive(mailbox->published);
+
+    return STATE_SLOT(next, BACK_SHIFT);
+}
+
+void odroid_framemailbox_close(odroid_framemailbox* mailbox)
+{
+    mailbox->closed = true;
+    xSemaphoreGive(mailbox->published);
+}
+
+int odroid_framemailbox_acquire(odroid_framemailbox* mailbox)
+{
+    while (1)
+    {
+        uint32_t state = mailbox->state;
+
+        if (mailbox->closed)
+            return -1;
+
+        if (state & STATE_FRESH)
+        {
+            uint32_t next = STATE_MAKE(STATE_SLOT(state, BACK_SHIFT),
+                                       STATE_SLOT(state, FRONT_SHIFT),
+                                       STATE_SLOT(state, READY_SHIFT));
+
+            if (state_exchange(mailbox, state, next))
+            {
+                ++mailbox->framesPresented;
+                return STATE_SLOT(next, FRONT_SHIFT);
+            }
+        }
+        else
+        {
+            xSemaphoreTake(mailbox->published, portMAX_DELAY);
+        }
+    }
+}
+
+void odroid_framemailbox_stats_get(odroid_framemailbox* mailbox, odroid_framemailbox_stats* stats)
+{
+    // The counters are never reset, so counts made while this runs are
+    // reported next time instead of being lost
+    const uint32_t presented = mailbox->framesPresented;
+    const uint32_t dropped = mailbox->framesDropped;
+
+    stats->framesPresented = presented - mailbox->presentedReported;
+    stats->framesDropped = dropped - mailbox->droppedReported;
+
+    mailbox->presentedReported = presented;
+    mailbox->droppedReported = dropped;
+}
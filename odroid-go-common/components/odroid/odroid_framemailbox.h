@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+
+#define ODROID_FRAMEMAILBOX_SLOTS (3)
+
+// Latest-wins exchange of three frame buffers between one producer (the
+// emulator) and one consumer (the video task). The producer owns the back
+// slot and never blocks; the consumer owns the front slot until it acquires
+// the next one. A published frame that is not acquired before the next
+// publish is dropped.
+typedef struct
+{
+    void* buffers[ODROID_FRAMEMAILBOX_SLOTS];
+    uint32_t sequence[ODROID_FRAMEMAILBOX_SLOTS];  // publish count of each slot
+
+    volatile uint32_t state;    // packed back/ready/front slots and fresh flag
+    volatile bool closed;
+    SemaphoreHandle_t published;
+    uint32_t publishCount;
+
+    // Running counts, each only written by one side. Read them through
+    // odroid_framemailbox_stats_get.
+    volatile uint32_t framesPresented;  // consumer
+    volatile uint32_t framesDropped;    // producer
+    uint32_t presentedReported;
+    uint32_t droppedReported;
+} odroid_framemailbox;
+
+typedef struct
+{
+    uint32_t framesPresented;
+    uint32_t framesDropped;
+} odroid_framemailbox_stats;
+
+
+void odroid_framemailbox_init(odroid_framemailbox* mailbox, void* buffer0, void* buffer1, void* buffer2);
+
+// Producer: the slot to draw the next frame into
+int odroid_framemailbox_back_get(odroid_framemailbox* mailbox);
+
+// Producer: hand over the back slot and return the new back slot
+int odroid_framemailbox_publish(odroid_framemailbox* mailbox);
+
+// Producer: wake the consumer and make acquire return -1
+void odroid_framemailbox_close(odroid_framemailbox* mailbox);
+
+// Consumer: wait for the newest published slot, or -1 once closed
+int odroid_framemailbox_acquire(odroid_framemailbox* mailbox);
+
+// Counts since the previous call. Call from one task only.
+void odroid_framemailbox_stats_get(odroid_framemailbox* mailbox, odroid_framemailbox_stats* stats);
@@ -0,0 +1,206 @@
+#include "odroid_framepace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#endif
+
+
+// Never drop more than this many frames in a row
+#define MAX_DROP_RUN (4)
+
+// Lag beyond this many frames (menus, loading) is forgiven
+#define MAX_LAG_FRAMES (30)
+
+// Shorter waits are spun out. Timer sleeps end this much early, and the
+// rest is spun to hide the wake up latency.
+#define MIN_SLEEP_MICROS (500)
+#define WAKE_MARGIN_MICROS (100)
+
+
+#ifdef ESP_PLATFORM
+static uint32_t default_clock()
+{
+    return xthal_get_ccount();
+}
+
+static void sleep_timer_callback(void* arg)
+{
+    xSemaphoreGive((SemaphoreHandle_t)arg);
+}
+#endif
+
+static void smooth(uint32_t* average, uint32_t sample)
+{
+    if (*average == 0)
+    {
+        *average = sample;
+    }
+    else
+    {
+        *average += ((int32_t)sample - (int32_t)*average) / 8;
+    }
+}
+
+void odroid_framepace_init(odroid_framepace* pace, float framesPerSecond, uint32_t clockRate, odroid_framepace_clock clock)
+{
+    memset(pace, 0, sizeof(*pace));
+
+#ifdef ESP_PLATFORM
+    if (!clock) clock = default_clock;
+#endif
+    if (!clock || framesPerSecond < 1.0f) abort();
+
+    pace->clock = clock;
+    pace->clockRate = clockRate;
+    pace->frameCycles = clockRate / framesPerSecond;
+    pace->frameSkip = ODROID_FRAMESKIP_AUTO;
+
+#ifdef ESP_PLATFORM
+    pace->sleepDone = xSemaphoreCreateBinary();
+    if (!pace->sleepDone) abort();
+
+    esp_timer_create_args_t timerArgs = {
+        .callback = sleep_timer_callback,
+        .arg = pace->sleepDone,
+        .name = "framepace"
+    };
+    if (esp_timer_create(&timerArgs, (esp_timer_handle_t*)&pace->sleepTimer) != ESP_OK) abort();
+
+    pace->lastSleep = clock();
+#endif
+}
+
+void odroid_framepace_frameskip_set(odroid_framepace* pace, int frameSkip)
+{
+    if (frameSkip < ODROID_FRAMESKIP_AUTO) abort();
+
+    pace->frameSkip = frameSkip;
+}
+
+// Blocks on a one-shot timer, then spins out the remainder. Blocking lets
+// the idle task of this core run; the task watchdog checks it.
+static uint32_t wait_until(odroid_framepace* pace, uint32_t start, uint32_t cycles)
+{
+    uint32_t now = pace->clock();
+
+#ifdef ESP_PLATFORM
+    if ((now - start) < cycles)
+    {
+        const uint32_t remaining = cycles - (now - start);
+        const uint32_t micros = (uint64_t)remaining * 1000000 / pace->clockRate;
+
+        if (micros >= MIN_SLEEP_MICROS)
+        {
+            esp_timer_start_once((esp_timer_handle_t)pace->sleepTimer, micros - WAKE_MARGIN_MICROS);
+            xSemaphoreTake((SemaphoreHandle_t)pace->sleepDone, portMAX_DELAY);
+
+            now = pace->clock();
+            pace->lastSleep = now;
+        }
+    }
+#endif
+
+    while ((now - start) < cycles)
+    {
+        now = pace->clock();
+    }
+
+    return now;
+}
+
+ODROID_FRAME_ACTION odroid_framepace_frame_begin(odroid_framepace* pace)
+{
+    uint32_t now = pace->clock();
+    const int32_t frameCycles = pace->frameCycles;
+
+    if (pace->started)
+    {
+        const uint32_t elapsed = now - pace->frameStart;
+
+        if (pace->action == ODROID_FRAME_PRESENT)
+            smooth(&pace->renderedCost, elapsed);
+        else
+            smooth(&pace->droppedCost, elapsed);
+
+        pace->lag += (int32_t)elapsed - frameCycles;
+
+        // Ahead of real time: wait until the frame is due. This is what
+        // sets the emulation rate.
+        if (pace->lag < 0)
+        {
+            now = wait_until(pace, now, -pace->lag);
+            pace->lag = 0;
+        }
+
+        if (pace->lag > frameCycles * MAX_LAG_FRAMES) pace->lag = 0;
+
+#ifdef ESP_PLATFORM
+        // Running behind never waits. Give the idle task a tick every
+        // second anyway so that the watchdog is fed.
+        if (now - pace->lastSleep >= pace->clockRate)
+        {
+            vTaskDelay(1);
+
+            const uint32_t woke = pace->clock();
+            pace->lag += woke - now;
+            now = woke;
+            pace->lastSleep = now;
+        }
+#endif
+    }
+
+    pace->started = true;
+    pace->frameStart = now;
+
+    // Behind real time: drop frames to catch up
+    bool behind = pace->lag > frameCycles;
+
+    // The display takes presentCost per frame. A frame started now is handed
+    // over about as long after now as the previous one was after lastPresent,
+    // so it only waits if the display is slower than that gap.
+    bool displayReady = !pace->presentBusy ||
+        (now - pace->lastPresent) >= pace->presentCost;
+
+    bool present;
+    if (pace->frameSkip == ODROID_FRAMESKIP_AUTO)
+        present = (!behind && displayReady) || pace->dropRun >= MAX_DROP_RUN;
+    else
+        present = pace->dropRun >= pace->frameSkip;
+
+    if (present)
+    {
+        pace->action = ODROID_FRAME_PRESENT;
+        pace->lastPresent = now;
+        pace->presentBusy = true;
+        pace->dropRun = 0;
+        ++pace->framesPresented;
+    }
+    else
+    {
+        pace->action = ODROID_FRAME_DROP;
+        ++pace->dropRun;
+        ++pace->framesDropped;
+    }
+
+    return pace->action;
+}
+
+void odroid_framepace_present_begin(odroid_framepace* pace)
+{
+    pace->presentStart = pace->clock();
+}
+
+void odroid_framepace_present_end(odroid_framepace* pace)
+{
+    uint32_t cost = pace->presentCost;
+    smooth(&cost, pace->clock() - pace->presentStart);
+
+    pace->presentCost = cost;
+    pace->presentBusy = false;
+}
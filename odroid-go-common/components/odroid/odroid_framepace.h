@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Returns a free running cycle count
+typedef uint32_t (*odroid_framepace_clock)();
+
+// Frame skip policies for odroid_framepace_frameskip_set
+#define ODROID_FRAMESKIP_AUTO (-1)  // drop frames only to keep up
+#define ODROID_FRAMESKIP_NONE (0)   // present every frame, slowing down if needed
+
+typedef enum
+{
+    ODROID_FRAME_DROP = 0,      // emulate the frame without rendering it
+    ODROID_FRAME_PRESENT        // render the frame and send it to the display
+} ODROID_FRAME_ACTION;
+
+typedef struct
+{
+    odroid_framepace_clock clock;
+    uint32_t clockRate;
+    uint32_t frameCycles;       // real time per emulated frame
+
+    // Emulation side
+    bool started;
+    ODROID_FRAME_ACTION action; // decision for the current frame
+    uint32_t frameStart;
+    int32_t lag;                // emulation behind real time
+    uint32_t renderedCost;      // smoothed cycles per rendered frame
+    uint32_t droppedCost;       // smoothed cycles per dropped frame
+    uint32_t lastPresent;       // when the last presented frame was started
+    int dropRun;                // consecutive dropped frames
+    int frameSkip;              // ODROID_FRAMESKIP_* or frames dropped per present
+
+    // Display side, measured on the display task's clock
+    volatile bool presentBusy;
+    volatile uint32_t presentStart;
+    volatile uint32_t presentCost;  // smoothed cycles per present
+
+    // Sleeping on the device, see odroid_framepace_init
+    void* sleepTimer;           // esp_timer_handle_t
+    void* sleepDone;            // SemaphoreHandle_t
+    uint32_t lastSleep;
+
+    // Counters, may be cleared by the caller
+    uint32_t framesPresented;
+    uint32_t framesDropped;
+} odroid_framepace;
+
+
+// clock may be NULL for the CPU cycle counter, clockRate is in Hz
+void odroid_framepace_init(odroid_framepace* pace, float framesPerSecond, uint32_t clockRate, odroid_framepace_clock clock);
+
+// ODROID_FRAMESKIP_AUTO (the default), ODROID_FRAMESKIP_NONE, or n > 0 to
+// present one frame in every n + 1
+void odroid_framepace_frameskip_set(odroid_framepace* pace, int frameSkip);
+
+// Call at the start of every emulated frame. Waits when emulation is ahead
+// of real time.
+ODROID_FRAME_ACTION odroid_framepace_frame_begin(odroid_framepace* pace);
+
+// Call from the display task around sending a presented frame
+void odroid_framepace_present_begin(odroid_framepace* pace);
+void odroid_framepace_present_end(odroid_framepace* pace);
@@ -8,18 +8,90 @@
 #include "driver/gpio.h"
 #include <driver/adc.h>
 #include "esp_adc_cal.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 //extern void backlight_percentage_set(int value);
 
 static volatile bool input_task_is_running = false;
 static volatile odroid_gamepad_state gamepad_state;
 static odroid_gamepad_state previous_gamepad_state;
-static uint8_t debounce[ODROID_INPUT_MAX];
 static volatile bool input_gamepad_initialized = false;
 static SemaphoreHandle_t xSemaphore;
+static TaskHandle_t input_task_handle;
+
+// A change is accepted at once, then further changes of that input are
+// ignored until the contacts settle
+#define DEBOUNCE_MICROS (5000)
+
+// The d-pad is analog and can only be polled
+#define POLL_MICROS (10000)
+
+static int64_t last_change[ODROID_INPUT_MAX];
+
+// Buttons wired to interrupt capable pins
+static const struct
+{
+    gpio_num_t pin;
+    int input;
+} edge_inputs[] = {
+    { ODROID_GAMEPAD_IO_SELECT, ODROID_INPUT_SELECT },
+    { ODROID_GAMEPAD_IO_START, ODROID_INPUT_START },
+    { ODROID_GAMEPAD_IO_A, ODROID_INPUT_A },
+    { ODROID_GAMEPAD_IO_B, ODROID_INPUT_B },
+    { ODROID_GAMEPAD_IO_MENU, ODROID_INPUT_MENU },
+    { ODROID_GAMEPAD_IO_VOLUME, ODROID_INPUT_VOLUME },
+};
+#define EDGE_INPUT_COUNT (sizeof(edge_inputs) / sizeof(edge_inputs[0]))
+
+// First edge seen since the input last changed, written by the ISR
+static volatile int64_t edge_time[ODROID_INPUT_MAX];
+
+// Single producer (input task), single consumer (emulator) event queue
+#define EVENT_QUEUE_SIZE (64)
+#define EVENT_QUEUE_MASK (EVENT_QUEUE_SIZE - 1)
+static odroid_input_event event_queue[EVENT_QUEUE_SIZE];
+static volatile uint32_t event_head;
+static volatile uint32_t event_tail;
+
+// Set when an event was dropped; the consumer then resyncs to gamepad_state
+static volatile bool event_overflow;
+
+// Event statistics. Events and latency belong to the consumer, which also
+// reads them, and are reset by odroid_input_stats_get. Drops are counted
+// by the input task, so they only grow and are reported as a change.
+static volatile uint32_t stats_events;
+static volatile uint32_t stats_dropped;
+static uint32_t stats_dropped_reported;
+static int64_t stats_latency_sum;
+
+// Input script: runs of (button mask, frame count), little endian
+#define SCRIPT_MAGIC "OGIS"
+#define SCRIPT_VERSION (1)
+#define SCRIPT_HEADER_SIZE (8)
+#define SCRIPT_MAX_RUNS (65536)
+#define SCRIPT_LIVE_MASK ((1 << ODROID_INPUT_MENU) | (1 << ODROID_INPUT_VOLUME))
+
+typedef struct
+{
+    uint16_t buttons;
+    uint16_t frames;
+} script_run;
+
+static ODROID_INPUT_SCRIPT script_mode = ODROID_INPUT_SCRIPT_NONE;
+static char* script_path;
+static script_run* script_runs;
+static uint32_t script_run_count;
+static uint32_t script_run_capacity;
+static uint32_t script_position;
+static uint32_t script_frame;
+static bool script_done;
 
 static esp_adc_cal_characteristics_t characteristics;
 static bool input_battery_initialized = false;
@@ -84,28 +156,47 @@ odroid_gamepad_state odroid_input_read_raw()
     return state;
 }
 
-static void odroid_input_task(void *arg)
+static void IRAM_ATTR input_edge_isr(void* arg)
 {
-    input_task_is_running = true;
+    const int input = (int)arg;
+
+    if (!edge_time[input])
+        edge_time[input] = esp_timer_get_time();
+
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(input_task_handle, &woken);
 
-    // Initialize state
-    for(int i = 0; i < ODROID_INPUT_MAX; ++i)
+    if (woken) portYIELD_FROM_ISR();
+}
+
+static void event_push(int input, int pressed, int64_t time)
+{
+    const uint32_t head = event_head;
+
+    if (head - event_tail >= EVENT_QUEUE_SIZE)
     {
-        debounce[i] = 0xff;
+        ++stats_dropped;
+        event_overflow = true;
+        return;
     }
 
+    odroid_input_event* event = &event_queue[head & EVENT_QUEUE_MASK];
+    event->time = time;
+    event->input = input;
+    event->pressed = pressed;
+
+    event_head = head + 1;
+}
+
+static void odroid_input_task(void *arg)
+{
+    input_task_is_running = true;
+
     BacklightLevel = odroid_settings_Backlight_get();
     bool changed = false;
 
     while(input_task_is_running)
     {
-        // Shift current values
-        for(int i = 0; i < ODROID_INPUT_MAX; ++i)
-		{
-			debounce[i] <<= 1;
-		}
-
-
         // Read hardware
 #if 1
 
@@ -160,28 +251,30 @@ static void odroid_input_task(void *arg)
 #endif
 
         // Debounce
+        const int64_t now = esp_timer_get_time();
+
         xSemaphoreTake(xSemaphore, portMAX_DELAY);
 
         for(int i = 0; i < ODROID_INPUT_MAX; ++i)
 		{
-            debounce[i] |= state.values[i] ? 1 : 0;
-            uint8_t val = debounce[i] & 0x03; //0x0f;
-            switch (val) {
-                case 0x00:
-                    gamepad_state.values[i] = 0;
-                    break;
-
-                case 0x03: //0x0f:
-                    gamepad_state.values[i] = 1;
-                    break;
-
-                default:
-                    // ignore
-                    break;
+            if (state.values[i] == gamepad_state.values[i] ||
+                now - last_change[i] < DEBOUNCE_MICROS)
+            {
+                continue;
             }
 
-            //gamepad_state.values[i] = (debounce[i] == 0xff);
-            //printf("odroid_input_task: %d=%d (raw=%d)\n", i, gamepad_state.values[i], state.values[i]);
+            // Stamp buttons with their interrupt, the d-pad with this poll
+            int64_t time = edge_time[i];
+            if (!time || now - time > POLL_MICROS * 2)
+                time = now;
+
+            edge_time[i] = 0;
+            last_change[i] = now;
+
+            gamepad_state.values[i] = state.values[i];
+            event_push(i, state.values[i], time);
+
+            //printf("odroid_input_task: %d=%d\n", i, gamepad_state.values[i]);
 		}
 
         if (gamepad_state.values[ODROID_INPUT_START])
@@ -237,8 +330,13 @@ static void odroid_input_task(void *arg)
         xSemaphoreGive(xSemaphore);
 
 
-        // delay
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        // Wait for a button edge or the next d-pad poll
+        ulTaskNotifyTake(pdTRUE, POLL_MICROS / 1000 / portTICK_PERIOD_MS);
+    }
+
+    for (int i = 0; i < EDGE_INPUT_COUNT; ++i)
+    {
+        gpio_isr_handler_remove(edge_inputs[i].pin);
     }
 
     input_gamepad_initialized = false;
@@ -287,7 +385,19 @@ void odroid_input_gamepad_init()
     input_gamepad_initialized = true;
 
     // Start background polling
-    xTaskCreatePinnedToCore(&odroid_input_task, "odroid_input_task", 1024 * 2, NULL, 5, NULL, 1);
+    xTaskCreatePinnedToCore(&odroid_input_task, "odroid_input_task", 1024 * 2, NULL, 5, &input_task_handle, 1);
+
+    // Wake the task on button edges. The service may already be installed.
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) abort();
+
+    for (int i = 0; i < EDGE_INPUT_COUNT; ++i)
+    {
+        gpio_set_intr_type(edge_inputs[i].pin, GPIO_INTR_ANYEDGE);
+
+        err = gpio_isr_handler_add(edge_inputs[i].pin, &input_edge_isr, (void*)edge_inputs[i].input);
+        if (err != ESP_OK) abort();
+    }
 
   	printf("odroid_input_gamepad_init done.\n");
 
@@ -311,6 +421,265 @@ void odroid_input_gamepad_read(odroid_gamepad_state* out_state)
     xSemaphoreGive(xSemaphore);
 }
 
+void odroid_input_events_begin(odroid_gamepad_state* out_state)
+{
+    if (!input_gamepad_initialized) abort();
+
+    xSemaphoreTake(xSemaphore, portMAX_DELAY);
+
+    *out_state = gamepad_state;
+    event_tail = event_head;
+    event_overflow = false;
+
+    xSemaphoreGive(xSemaphore);
+}
+
+static uint16_t script_buttons_get(const odroid_gamepad_state* state)
+{
+    uint16_t buttons = 0;
+    for (int i = 0; i < ODROID_INPUT_MAX; ++i)
+    {
+        if (state->values[i]) buttons |= 1 << i;
+    }
+
+    return buttons;
+}
+
+static void script_record(const odroid_gamepad_state* state)
+{
+    const uint16_t buttons = script_buttons_get(state) & ~SCRIPT_LIVE_MASK;
+
+    if (script_run_count > 0)
+    {
+        script_run* last = &script_runs[script_run_count - 1];
+        if (last->buttons == buttons && last->frames < UINT16_MAX)
+        {
+            ++last->frames;
+            return;
+        }
+    }
+
+    if (script_run_count == script_run_capacity)
+    {
+        if (script_run_capacity == SCRIPT_MAX_RUNS)
+        {
+            printf("odroid_input_script: recording full, stopped.\n");
+            script_mode = ODROID_INPUT_SCRIPT_NONE;
+            return;
+        }
+
+        uint32_t capacity = script_run_capacity ? script_run_capacity * 2 : 1024;
+        script_run* runs = realloc(script_runs, capacity * sizeof(script_run));
+        if (!runs)
+        {
+            printf("odroid_input_script: out of memory, recording stopped.\n");
+            script_mode = ODROID_INPUT_SCRIPT_NONE;
+            return;
+        }
+
+        script_runs = runs;
+        script_run_capacity = capacity;
+    }
+
+    script_runs[script_run_count].buttons = buttons;
+    script_runs[script_run_count].frames = 1;
+    ++script_run_count;
+}
+
+static void script_replay(odroid_gamepad_state* state)
+{
+    if (script_done)
+        return;
+
+    if (script_position >= script_run_count)
+    {
+        printf("odroid_input_script: replay finished.\n");
+        script_done = true;
+
+        // Hand back to the hardware state
+        odroid_gamepad_state live;
+        odroid_input_gamepad_read(&live);
+        for (int i = 0; i < ODROID_INPUT_MAX; ++i)
+        {
+            if (!(SCRIPT_LIVE_MASK & (1 << i))) state->values[i] = live.values[i];
+        }
+        return;
+    }
+
+    const script_run* run = &script_runs[script_position];
+    for (int i = 0; i < ODROID_INPUT_MAX; ++i)
+    {
+        if (!(SCRIPT_LIVE_MASK & (1 << i))) state->values[i] = (run->buttons >> i) & 1;
+    }
+
+    if (++script_frame >= run->frames)
+    {
+        script_frame = 0;
+        ++script_position;
+    }
+}
+
+int odroid_input_events_apply(odroid_gamepad_state* state)
+{
+    const int64_t now = esp_timer_get_time();
+
+    uint32_t changed = 0;
+    int count = 0;
+
+    // A dropped event, such as a release, would leave the state wrong
+    // until that input changes again. Start over from the debounced state.
+    if (event_overflow)
+        odroid_input_events_begin(state);
+
+    uint32_t tail = event_tail;
+    while (tail != event_head)
+    {
+        const odroid_input_event* event = &event_queue[tail & EVENT_QUEUE_MASK];
+
+        // Leave a second change of the same input for the next frame so a
+        // tap shorter than a frame is still seen
+        if (changed & (1 << event->input))
+            break;
+
+        changed |= 1 << event->input;
+        state->values[event->input] = event->pressed;
+
+        stats_latency_sum += now - event->time;
+        ++stats_events;
+        ++count;
+
+        ++tail;
+    }
+
+    event_tail = tail;
+
+    if (script_mode == ODROID_INPUT_SCRIPT_REPLAY)
+        script_replay(state);
+    else if (script_mode == ODROID_INPUT_SCRIPT_RECORD)
+        script_record(state);
+
+    return count;
+}
+
+void odroid_input_stats_get(odroid_input_stats* stats)
+{
+    const uint32_t dropped = stats_dropped;
+
+    stats->events = stats_events;
+    stats->dropped = dropped - stats_dropped_reported;
+    stats->latencyMicros = stats_events ? stats_latency_sum / stats_events : 0;
+
+    stats_events = 0;
+    stats_dropped_reported = dropped;
+    stats_latency_sum = 0;
+}
+
+
+ODROID_INPUT_SCRIPT odroid_input_script_init(const char* base_path, const char* romPath)
+{
+    if (script_mode != ODROID_INPUT_SCRIPT_NONE) abort();
+    if (!romPath) return ODROID_INPUT_SCRIPT_NONE;
+
+    const char* fileName = strrchr(romPath, '/');
+    fileName = fileName ? fileName + 1 : romPath;
+
+    const char* pathFormat = "%s/odroid/input/%s.inp";
+    size_t pathLength = snprintf(NULL, 0, pathFormat, base_path, fileName) + 1;
+    script_path = malloc(pathLength);
+    if (!script_path) abort();
+    snprintf(script_path, pathLength, pathFormat, base_path, fileName);
+
+    FILE* f = fopen(script_path, "rb");
+    if (!f)
+    {
+        free(script_path);
+        script_path = NULL;
+        return ODROID_INPUT_SCRIPT_NONE;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (size == 0)
+    {
+        // An empty file asks for a recording
+        fclose(f);
+        script_mode = ODROID_INPUT_SCRIPT_RECORD;
+        printf("odroid_input_script_init: recording to '%s'.\n", script_path);
+        return script_mode;
+    }
+
+    uint8_t header[SCRIPT_HEADER_SIZE];
+    uint32_t count = (size - SCRIPT_HEADER_SIZE) / 4;
+
+    if (size < SCRIPT_HEADER_SIZE ||
+        fread(header, 1, SCRIPT_HEADER_SIZE, f) != SCRIPT_HEADER_SIZE ||
+        memcmp(header, SCRIPT_MAGIC, 4) != 0 ||
+        (header[4] | (header[5] << 8)) != SCRIPT_VERSION)
+    {
+        printf("odroid_input_script_init: '%s' is not a version %d script.\n", script_path, SCRIPT_VERSION);
+        fclose(f);
+        free(script_path);
+        script_path = NULL;
+        return ODROID_INPUT_SCRIPT_NONE;
+    }
+
+    script_runs = malloc(count * sizeof(script_run) + 1);
+    if (!script_runs) abort();
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint8_t run[4];
+        if (fread(run, 1, 4, f) != 4) abort();
+
+        script_runs[i].buttons = run[0] | (run[1] << 8);
+        script_runs[i].frames = run[2] | (run[3] << 8);
+    }
+
+    fclose(f);
+
+    script_run_count = count;
+    script_run_capacity = count;
+    script_mode = ODROID_INPUT_SCRIPT_REPLAY;
+
+    printf("odroid_input_script_init: replaying %d runs from '%s'.\n", count, script_path);
+    return script_mode;
+}
+
+ODROID_INPUT_SCRIPT odroid_input_script_mode_get()
+{
+    return script_mode;
+}
+
+void odroid_input_script_save()
+{
+    if (script_mode != ODROID_INPUT_SCRIPT_RECORD) return;
+
+    FILE* f = fopen(script_path, "wb");
+    if (!f)
+    {
+        printf("odroid_input_script_save: fopen '%s' failed.\n", script_path);
+        return;
+    }
+
+    uint8_t header[SCRIPT_HEADER_SIZE] = { 'O', 'G', 'I', 'S', SCRIPT_VERSION, 0, 0, 0 };
+    fwrite(header, 1, SCRIPT_HEADER_SIZE, f);
+
+    for (uint32_t i = 0; i < script_run_count; ++i)
+    {
+        uint8_t run[4] = {
+            script_runs[i].buttons & 0xff, script_runs[i].buttons >> 8,
+            script_runs[i].frames & 0xff, script_runs[i].frames >> 8
+        };
+        fwrite(run, 1, 4, f);
+    }
+
+    fclose(f);
+
+    printf("odroid_input_script_save: wrote %d runs to '%s'.\n", script_run_count, script_path);
+}
+
 
 static void odroid_battery_monitor_task()
 {
@@ -40,11 +40,56 @@ typedef struct
 	int percentage;
 } odroid_battery_state;
 
+typedef struct
+{
+    int64_t time;       // esp_timer microseconds of the edge or poll
+    uint8_t input;      // ODROID_INPUT_*
+    uint8_t pressed;
+} odroid_input_event;
+
+typedef struct
+{
+    uint32_t events;
+    uint32_t dropped;           // queue was full
+    uint32_t latencyMicros;     // average age of an event when applied
+} odroid_input_stats;
+
 void odroid_input_gamepad_init();
 void odroid_input_gamepad_terminate();
 void odroid_input_gamepad_read(odroid_gamepad_state* out_state);
 odroid_gamepad_state odroid_input_read_raw();
 
+// Snapshots the gamepad and discards queued events. The caller then keeps
+// the state current with odroid_input_events_apply once per emulated frame.
+// Only one task may consume events.
+void odroid_input_events_begin(odroid_gamepad_state* out_state);
+
+// Applies queued events in order, at most one change per input per call.
+// After the queue overflowed, resyncs to the current state instead.
+// Returns the number of events applied.
+int odroid_input_events_apply(odroid_gamepad_state* state);
+
+// Returns the totals since the previous call. Call from the task that
+// applies events.
+void odroid_input_stats_get(odroid_input_stats* stats);
+
+typedef enum
+{
+    ODROID_INPUT_SCRIPT_NONE = 0,
+    ODROID_INPUT_SCRIPT_RECORD,
+    ODROID_INPUT_SCRIPT_REPLAY
+} ODROID_INPUT_SCRIPT;
+
+// Looks for <base_path>/odroid/input/<rom file name>.inp. An empty file
+// starts a recording; a script file replaces all buttons except MENU and
+// VOLUME, one run-length entry per odroid_input_events_apply call, until it
+// ends. The mode is fixed for the session. The SD card must be mounted.
+ODROID_INPUT_SCRIPT odroid_input_script_init(const char* base_path, const char* romPath);
+ODROID_INPUT_SCRIPT odroid_input_script_mode_get();
+
+// Writes the recording, if any. The SD card must be mounted.
+void odroid_input_script_save();
+
 void odroid_input_battery_level_init();
 void odroid_input_battery_level_read(odroid_battery_state* out_state);
 void odroid_input_battery_level_force_voltage(float volts);
@@ -8,6 +8,11 @@
 #include "sdmmc_cmd.h"
 #include "esp_heap_caps.h"
 #include "esp_spiffs.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include <dirent.h>
 #include <string.h>
@@ -24,6 +29,65 @@
 
 static bool isOpen = false;
 
+// Allocated on the first read, freed by odroid_sdcard_close
+static uint8_t* readBuffer;
+
+// Serializes reads between the caller and the cache task. Recursive
+// because a cache fill holds it across its claim and its read.
+static SemaphoreHandle_t readMutex;
+
+// Pins that keep a cached block from being evicted
+#define CACHE_PINS (2)
+
+#define CACHE_HINT_COUNT (8)
+
+// Time between blocks read without a hint
+#define CACHE_SWEEP_MS (20)
+
+#define CACHE_NONE (-1)
+
+// Blocks of one file kept in a pool of fixed size slots. The metadata is
+// shared with the prefetch task under cacheLock; slots are only claimed
+// with readMutex held, so one claim is in progress at a time.
+static struct
+{
+    FILE* file;
+    uint8_t* pool;
+    size_t blockSize;
+    int blockCount;
+    int slotCount;
+    odroid_sdcard_bus_lock lock;
+    odroid_sdcard_bus_lock unlock;
+
+    int16_t* blockSlot;         // slot holding each block, or CACHE_NONE
+    int16_t* slotBlock;         // block in each slot, or CACHE_NONE
+    uint8_t* slotReferenced;    // clock replacement bits
+    int16_t pins[CACHE_PINS];
+    int unusedSlot;             // slots from here on were never used
+    int hand;
+
+    QueueHandle_t hints;
+    const uint16_t* order;      // blocks to sweep first
+    int orderCount;
+    int orderPosition;
+    int sweep;                  // next block to read without a hint
+    volatile bool running;
+    volatile bool stopped;
+} cache;
+
+static portMUX_TYPE cacheLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Read statistics. The cache task updates them on core 1, so they are
+// never reset: they only grow, each in a single 32 bit word, and
+// odroid_sdcard_stats_get reports their change since its previous call.
+static volatile uint32_t stats_bytes;
+static volatile uint32_t stats_micros;
+static volatile uint32_t stats_prefetched;
+static volatile uint32_t stats_hits;
+static volatile uint32_t stats_misses;
+static volatile uint32_t stats_evictions;
+static odroid_sdcard_stats stats_reported;  // totals at the previous call
+
 
 esp_err_t odroid_sdcard_open(const char* base_path)
 {
@@ -36,6 +100,12 @@ esp_err_t odroid_sdcard_open(const char* base_path)
     }
     else
     {
+        if (!readMutex)
+        {
+            readMutex = xSemaphoreCreateRecursiveMutex();
+            if (!readMutex) abort();
+        }
+
         sdmmc_host_t host = SDSPI_HOST_DEFAULT();
     	host.slot = HSPI_HOST; // HSPI_HOST;
     	//host.max_freq_khz = SDMMC_FREQ_HIGHSPEED; //10000000;
@@ -90,8 +160,13 @@ esp_err_t odroid_sdcard_close()
     }
     else
     {
+        if (cache.running) abort();
+
         ret = esp_vfs_fat_sdmmc_unmount();
 
+        free(readBuffer);
+        readBuffer = NULL;
+
         if (ret != ESP_OK)
         {
             printf("odroid_sdcard_close: esp_vfs_fat_sdmmc_unmount failed (%d)\n", ret);
@@ -154,23 +229,368 @@ size_t odroid_sdcard_copy_file_to_memory(const char* path, void* ptr)
             }
             else
             {
-                // copy
-                const size_t BLOCK_SIZE = 512;
-                while(true)
+                fseek(f, 0, SEEK_END);
+                size_t size = ftell(f);
+
+                const int64_t startTime = esp_timer_get_time();
+
+                ret = odroid_sdcard_read(f, 0, ptr, size);
+                fclose(f);
+
+                const int64_t elapsed = esp_timer_get_time() - startTime;
+                printf("odroid_sdcard_copy_file_to_memory: %u bytes in %dms (%d KB/s).\n",
+                    (unsigned)ret, (int)(elapsed / 1000), elapsed ? (int)(ret * 1000000LL / 1024 / elapsed) : 0);
+            }
+        }
+    }
+
+    return ret;
+}
+
+size_t odroid_sdcard_read(FILE* file, size_t offset, void* dest, size_t size)
+{
+    size_t ret = 0;
+
+    if (!isOpen)
+    {
+        printf("odroid_sdcard_read: not open.\n");
+        return 0;
+    }
+
+    xSemaphoreTakeRecursive(readMutex, portMAX_DELAY);
+
+    if (!readBuffer)
+    {
+        readBuffer = heap_caps_malloc(ODROID_SDCARD_READ_CHUNK, MALLOC_CAP_DMA | MALLOC_CAP_8BIT);
+        if (!readBuffer) abort();
+    }
+
+    const int64_t startTime = esp_timer_get_time();
+
+    if (fseek(file, offset, SEEK_SET))
+    {
+        printf("odroid_sdcard_read: fseek failed. offset=%u\n", (unsigned)offset);
+        xSemaphoreGiveRecursive(readMutex);
+        return 0;
+    }
+
+    while (ret < size)
+    {
+        // Stop at the next chunk boundary so the following reads are aligned
+        size_t count = ODROID_SDCARD_READ_CHUNK - ((offset + ret) % ODROID_SDCARD_READ_CHUNK);
+        if (count > size - ret) count = size - ret;
+
+        size_t read = fread(readBuffer, 1, count, file);
+
+        memcpy((uint8_t*)dest + ret, readBuffer, read);
+        __asm__("memw");
+
+        ret += read;
+
+        if (read < count) break;
+    }
+
+    stats_bytes += ret;
+    stats_micros += (uint32_t)(esp_timer_get_time() - startTime);
+
+    xSemaphoreGiveRecursive(readMutex);
+
+    return ret;
+}
+
+void odroid_sdcard_stats_get(odroid_sdcard_stats* stats)
+{
+    odroid_sdcard_stats totals;
+    totals.bytes = stats_bytes;
+    totals.micros = stats_micros;
+    totals.kilobytesPerSecond = 0;
+    totals.prefetched = stats_prefetched;
+    totals.hits = stats_hits;
+    totals.misses = stats_misses;
+    totals.evictions = stats_evictions;
+
+    stats->bytes = totals.bytes - stats_reported.bytes;
+    stats->micros = totals.micros - stats_reported.micros;
+    stats->kilobytesPerSecond = stats->micros ? (uint64_t)stats->bytes * 1000000 / 1024 / stats->micros : 0;
+    stats->prefetched = totals.prefetched - stats_reported.prefetched;
+    stats->hits = totals.hits - stats_reported.hits;
+    stats->misses = totals.misses - stats_reported.misses;
+    stats->evictions = totals.evictions - stats_reported.evictions;
+
+    stats_reported = totals;
+}
+
+// Returns a slot for a new block, or CACHE_NONE if only an eviction would
+// free one and evict is false. Called with cacheLock held.
+static int cache_claim(bool evict)
+{
+    if (cache.unusedSlot < cache.slotCount)
+        return cache.unusedSlot++;
+
+    if (!evict)
+        return CACHE_NONE;
+
+    // Two turns of the clock clear every reference bit
+    for (int i = 0; i < cache.slotCount * 2; ++i)
+    {
+        const int slot = cache.hand;
+        cache.hand = (cache.hand + 1) % cache.slotCount;
+
+        bool pinned = false;
+        for (int pin = 0; pin < CACHE_PINS; ++pin)
+        {
+            if (cache.pins[pin] == slot) pinned = true;
+        }
+
+        if (pinned) continue;
+
+        if (cache.slotReferenced[slot])
+        {
+            cache.slotReferenced[slot] = 0;
+            continue;
+        }
+
+        const int victim = cache.slotBlock[slot];
+        if (victim != CACHE_NONE)
+        {
+            cache.blockSlot[victim] = CACHE_NONE;
+            cache.slotBlock[slot] = CACHE_NONE;
+            ++stats_evictions;
+        }
+
+        return slot;
+    }
+
+    // Every slot is pinned
+    abort();
+}
+
+// Makes block resident and returns its slot, or CACHE_NONE. pin may be -1.
+// Called with the bus lock held.
+static int cache_fill(int block, bool evict, int pin)
+{
+    xSemaphoreTakeRecursive(readMutex, portMAX_DELAY);
+
+    portENTER_CRITICAL(&cacheLock);
+
+    int slot = cache.blockSlot[block];
+    bool resident = (slot != CACHE_NONE);
+
+    if (resident)
+    {
+        if (pin >= 0) cache.pins[pin] = slot;
+    }
+    else
+    {
+        slot = cache_claim(evict);
+    }
+
+    portEXIT_CRITICAL(&cacheLock);
+
+    if (!resident && slot != CACHE_NONE)
+    {
+        const size_t size = cache.blockSize;
+        size_t count = odroid_sdcard_read(cache.file, block * size, cache.pool + slot * size, size);
+
+        portENTER_CRITICAL(&cacheLock);
+
+        if (count < size)
+        {
+            // The slot stays empty for the clock to hand out again
+            slot = CACHE_NONE;
+        }
+        else
+        {
+            cache.blockSlot[block] = slot;
+            cache.slotBlock[slot] = block;
+            cache.slotReferenced[slot] = 1;
+            if (pin >= 0) cache.pins[pin] = slot;
+        }
+
+        portEXIT_CRITICAL(&cacheLock);
+    }
+
+    xSemaphoreGiveRecursive(readMutex);
+
+    return slot;
+}
+
+static void cache_task(void* arg)
+{
+    while (cache.running)
+    {
+        int block = CACHE_NONE;
+        bool sweeping = cache.sweep < cache.blockCount;
+        bool hinted = xQueueReceive(cache.hints, &block,
+            sweeping ? CACHE_SWEEP_MS / portTICK_PERIOD_MS : portMAX_DELAY);
+
+        if (!hinted)
+        {
+            // Nothing hinted, continue the sweep with the listed blocks
+            block = CACHE_NONE;
+            while (cache.orderPosition < cache.orderCount)
+            {
+                int next = cache.order[cache.orderPosition++];
+                if (next < cache.blockCount && cache.blockSlot[next] == CACHE_NONE)
                 {
-                    __asm__("memw");
-                    size_t count = fread((uint8_t*)ptr + ret, 1, BLOCK_SIZE, f);
-                    __asm__("memw");
+                    block = next;
+                    break;
+                }
+            }
 
-                    ret += count;
+            while (cache.sweep < cache.blockCount && cache.blockSlot[cache.sweep] != CACHE_NONE)
+                ++cache.sweep;
 
-                    if (count < BLOCK_SIZE) break;
+            if (block == CACHE_NONE)
+            {
+                if (cache.sweep == cache.blockCount)
+                {
+                    printf("odroid_sdcard_cache: all %d blocks loaded.\n", cache.blockCount);
+                    continue;
                 }
+
+                block = cache.sweep;
             }
         }
+
+        if (block == CACHE_NONE || cache.blockSlot[block] != CACHE_NONE)
+            continue;
+
+        // Hints may evict, the sweep only fills free slots
+        cache.lock();
+        int slot = cache_fill(block, hinted, -1);
+        cache.unlock();
+
+        if (slot != CACHE_NONE)
+        {
+            ++stats_prefetched;
+        }
+        else if (!hinted)
+        {
+            // The pool is full or the card failed; stop sweeping
+            cache.orderPosition = cache.orderCount;
+            cache.sweep = cache.blockCount;
+        }
     }
 
-    return ret;
+    cache.stopped = true;
+    vTaskDelete(NULL);
+}
+
+void odroid_sdcard_cache_start(FILE* file, void* pool, size_t poolSize, size_t blockSize, int blockCount,
+    const uint16_t* order, int orderCount, odroid_sdcard_bus_lock lock, odroid_sdcard_bus_lock unlock)
+{
+    if (!isOpen || cache.running) abort();
+    if (!file || !pool || !lock || !unlock || blockCount < 1) abort();
+
+    int slotCount = poolSize / blockSize;
+    if (slotCount > blockCount) slotCount = blockCount;
+
+    // Evicting needs a slot that is not pinned
+    if (slotCount < blockCount && slotCount <= CACHE_PINS) abort();
+
+    if (!cache.hints)
+    {
+        cache.hints = xQueueCreate(CACHE_HINT_COUNT, sizeof(int));
+        if (!cache.hints) abort();
+    }
+
+    free(cache.blockSlot);
+    free(cache.slotBlock);
+    free(cache.slotReferenced);
+
+    cache.blockSlot = malloc(blockCount * sizeof(int16_t));
+    cache.slotBlock = malloc(slotCount * sizeof(int16_t));
+    cache.slotReferenced = calloc(slotCount, 1);
+    if (!cache.blockSlot || !cache.slotBlock || !cache.slotReferenced) abort();
+
+    for (int i = 0; i < blockCount; ++i)
+        cache.blockSlot[i] = CACHE_NONE;
+
+    for (int i = 0; i < slotCount; ++i)
+        cache.slotBlock[i] = CACHE_NONE;
+
+    for (int i = 0; i < CACHE_PINS; ++i)
+        cache.pins[i] = CACHE_NONE;
+
+    cache.file = file;
+    cache.pool = pool;
+    cache.blockSize = blockSize;
+    cache.blockCount = blockCount;
+    cache.slotCount = slotCount;
+    cache.lock = lock;
+    cache.unlock = unlock;
+    cache.unusedSlot = 0;
+    cache.hand = 0;
+    cache.order = order;
+    cache.orderCount = order ? orderCount : 0;
+    cache.orderPosition = 0;
+    cache.sweep = 0;
+    cache.stopped = false;
+    cache.running = true;
+
+    printf("odroid_sdcard_cache_start: %d blocks, %d slots.\n", blockCount, slotCount);
+
+    // Below the audio feeder and the video task on the same core
+    xTaskCreatePinnedToCore(&cache_task, "sdCache", 4096, NULL, 3, NULL, 1);
+}
+
+uint8_t* odroid_sdcard_cache_get(int block, int pin)
+{
+    if (block < 0 || block >= cache.blockCount || pin < 0 || pin >= CACHE_PINS) abort();
+
+    portENTER_CRITICAL(&cacheLock);
+
+    const int slot = cache.blockSlot[block];
+    if (slot != CACHE_NONE)
+    {
+        cache.slotReferenced[slot] = 1;
+        cache.pins[pin] = slot;
+    }
+
+    portEXIT_CRITICAL(&cacheLock);
+
+    if (slot == CACHE_NONE)
+        return NULL;
+
+    ++stats_hits;
+    return cache.pool + slot * cache.blockSize;
+}
+
+uint8_t* odroid_sdcard_cache_load(int block, int pin)
+{
+    if (block < 0 || block >= cache.blockCount || pin < 0 || pin >= CACHE_PINS) abort();
+
+    ++stats_misses;
+
+    const int slot = cache_fill(block, true, pin);
+    return (slot != CACHE_NONE) ? cache.pool + slot * cache.blockSize : NULL;
+}
+
+void odroid_sdcard_cache_hint(int block)
+{
+    if (!cache.running || block < 0 || block >= cache.blockCount)
+        return;
+
+    if (cache.blockSlot[block] == CACHE_NONE)
+        xQueueSend(cache.hints, &block, 0);
+}
+
+void odroid_sdcard_cache_stop()
+{
+    if (!cache.running)
+        return;
+
+    cache.running = false;
+
+    // Wake the task
+    int block = CACHE_NONE;
+    xQueueSend(cache.hints, &block, portMAX_DELAY);
+
+    while (!cache.stopped)
+        vTaskDelay(1);
+
+    xQueueReset(cache.hints);
 }
 
 char* odroid_sdcard_create_savefile_path(const char* base_path, const char* fileName)
@@ -2,9 +2,68 @@
 
 #include "esp_err.h"
 
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Bytes per SD read. Reads are split at multiples of this within the file
+// so FAT can hand whole clusters to the card as one multi-block transfer.
+// Larger is faster but costs internal RAM while the card is open.
+#ifndef ODROID_SDCARD_READ_CHUNK
+#define ODROID_SDCARD_READ_CHUNK (16 * 1024)
+#endif
+
+typedef struct
+{
+    uint32_t bytes;
+    uint32_t micros;
+    uint32_t kilobytesPerSecond;
+    uint32_t prefetched;        // blocks loaded by the cache task
+    uint32_t hits;              // cache lookups that found the block
+    uint32_t misses;            // blocks the caller had to wait for
+    uint32_t evictions;
+} odroid_sdcard_stats;
+
+// Takes and releases whatever else uses the SD card's SPI pins
+typedef void (*odroid_sdcard_bus_lock)();
+
 
 esp_err_t odroid_sdcard_open(const char* base_path);
 esp_err_t odroid_sdcard_close();
 size_t odroid_sdcard_get_filesize(const char* path);
 size_t odroid_sdcard_copy_file_to_memory(const char* path, void* ptr);
+
+// Reads size bytes at offset of file into dest, which may be in PSRAM.
+// Goes through an internal RAM buffer that the SD driver can DMA into.
+// Returns the number of bytes read.
+size_t odroid_sdcard_read(FILE* file, size_t offset, void* dest, size_t size);
+
+// Returns the totals since the previous call. Call from one task only.
+void odroid_sdcard_stats_get(odroid_sdcard_stats* stats);
+
+// Keeps blocks of file in a pool of blockSize slots, replacing the least
+// recently used ones (clock policy) once the pool is full. A task on core 1
+// reads hinted blocks first, then fills free slots at a slow pace, with
+// those listed in order (may be NULL) first. order must stay valid until
+// the cache stops. lock and unlock guard the SPI bus around each read.
+void odroid_sdcard_cache_start(FILE* file, void* pool, size_t poolSize, size_t blockSize, int blockCount,
+    const uint16_t* order, int orderCount, odroid_sdcard_bus_lock lock, odroid_sdcard_bus_lock unlock);
+
+// Returns the block if it is resident, or NULL. Never blocks. The block is
+// held by pin (0 or 1) and not evicted until another block takes the pin.
+uint8_t* odroid_sdcard_cache_get(int block, int pin);
+
+// Reads a block that odroid_sdcard_cache_get did not return, waiting out a
+// prefetch in progress. The caller must hold the bus lock. Returns NULL if
+// the read failed.
+uint8_t* odroid_sdcard_cache_load(int block, int pin);
+
+// Asks for a block to be read soon. Never blocks; a hint that does not fit
+// in the queue is dropped.
+void odroid_sdcard_cache_hint(int block);
+
+// Stops the task. Resident blocks stay valid.
+void odroid_sdcard_cache_stop();
+
 char* odroid_sdcard_create_savefile_path(const char* base_path, const char* fileName);
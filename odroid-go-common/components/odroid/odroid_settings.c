@@ -2,8 +2,11 @@
 
 #include "nvs_flash.h"
 #include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 #include "string.h"
+#include "stddef.h"
 
 #include "odroid_audio.h"
 
@@ -19,6 +22,77 @@ static const char* NvsKey_Backlight = "Backlight";
 static const char* NvsKey_StartAction = "StartAction";
 static const char* NvsKey_ScaleDisabled = "ScaleDisabled";
 static const char* NvsKey_AudioSink = "AudioSink";
+static const char* NvsKeyFormat_RomProfile = "Rom%08x";
+
+
+// The namespace is read once by odroid_settings_init. Sets only change the
+// cached value; odroid_settings_commit writes the changed keys together.
+enum
+{
+    SETTING_VREF = 0,
+    SETTING_VOLUME,
+    SETTING_APP_SLOT,
+    SETTING_DATA_SLOT,
+    SETTING_BACKLIGHT,
+    SETTING_START_ACTION,
+    SETTING_SCALE_DISABLED,
+    SETTING_AUDIO_SINK,
+
+    SETTING_ROM_FILE_PATH,
+    SETTING_ROM_PROFILE,
+    SETTING_COUNT
+};
+
+static const char** const SettingKeys[SETTING_ROM_PROFILE] = {
+    &NvsKey_VRef,
+    &NvsKey_Volume,
+    &NvsKey_AppSlot,
+    &NvsKey_DataSlot,
+    &NvsKey_Backlight,
+    &NvsKey_StartAction,
+    &NvsKey_ScaleDisabled,
+    &NvsKey_AudioSink,
+    &NvsKey_RomFilePath
+};
+
+static int32_t settings[SETTING_ROM_FILE_PATH] = {
+    1100,                       // VRef
+    ODROID_VOLUME_LEVEL3,       // Volume
+    -1,                         // AppSlot
+    -1,                         // DataSlot
+    2,                          // Backlight
+    ODROID_START_ACTION_NORMAL, // StartAction
+    0,                          // ScaleDisabled
+    ODROID_AUDIO_SINK_SPEAKER   // AudioSink
+};
+static char* settings_rom_file_path;
+static uint32_t settings_dirty;
+static SemaphoreHandle_t settings_mutex;
+
+// Overrides for the running ROM, see odroid_settings_RomProfile_load
+static odroid_rom_profile rom_profile = {
+    ODROID_PROFILE_INHERIT, ODROID_PROFILE_INHERIT, ODROID_PROFILE_INHERIT, ODROID_PROFILE_INHERIT, 0,
+    ODROID_PROFILE_INHERIT
+};
+static char rom_profile_key[16];
+
+
+// Copies a profile into zeroed storage so that padding bytes, which are
+// compared and written to NVS, are always zero
+static void rom_profile_copy(odroid_rom_profile* dst, const odroid_rom_profile* src)
+{
+    odroid_rom_profile value;
+    memset(&value, 0, sizeof(value));
+
+    value.scaleDisabled = src->scaleDisabled;
+    value.audioSink = src->audioSink;
+    value.volume = src->volume;
+    value.frameSkip = src->frameSkip;
+    value.audioSampleRate = src->audioSampleRate;
+    value.idleSkip = src->idleSkip;
+
+    memcpy(dst, &value, sizeof(value));
+}
 
 
 char* odroid_util_GetFileName(const char* path)
@@ -127,9 +201,12 @@ char* odroid_util_GetFileNameWithoutExtension(const char* path)
 }
 
 
-int32_t odroid_settings_VRef_get()
+void odroid_settings_init()
 {
-    int32_t result = 1100;
+    if (settings_mutex) abort();
+
+    settings_mutex = xSemaphoreCreateMutex();
+    if (!settings_mutex) abort();
 
 	// Open
 	nvs_handle my_handle;
@@ -137,355 +214,377 @@ int32_t odroid_settings_VRef_get()
 	if (err != ESP_OK) abort();
 
 
-	// Read
-	err = nvs_get_i32(my_handle, NvsKey_VRef, &result);
-	if (err == ESP_OK)
+	// Read, keeping the default of any missing key
+    for (int i = 0; i < SETTING_ROM_FILE_PATH; ++i)
     {
-        printf("odroid_settings_VRefGet: value=%d\n", result);
-	}
+        err = nvs_get_i32(my_handle, *SettingKeys[i], &settings[i]);
+        if (err == ESP_OK)
+        {
+            printf("%s: %s=%d\n", __func__, *SettingKeys[i], settings[i]);
+        }
+    }
 
+    size_t required_size;
+    err = nvs_get_str(my_handle, NvsKey_RomFilePath, NULL, &required_size);
+    if (err == ESP_OK)
+    {
+        settings_rom_file_path = malloc(required_size);
+        if (!settings_rom_file_path) abort();
 
-	// Close
-	nvs_close(my_handle);
+        err = nvs_get_str(my_handle, NvsKey_RomFilePath, settings_rom_file_path, &required_size);
+        if (err != ESP_OK) abort();
 
-    return result;
-}
-void odroid_settings_VRef_set(int32_t value)
-{
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+        printf("%s: %s='%s'\n", __func__, NvsKey_RomFilePath, settings_rom_file_path);
+    }
 
-    // Write key
-    err = nvs_set_i32(my_handle, NvsKey_VRef, value);
-    if (err != ESP_OK) abort();
 
-    // Close
-    nvs_close(my_handle);
+	// Close
+	nvs_close(my_handle);
 }
 
-
-int32_t odroid_settings_Volume_get()
+void odroid_settings_commit()
 {
-    int result = ODROID_VOLUME_LEVEL3;
+    if (!settings_mutex) abort();
 
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
 
-    // Read
-    err = nvs_get_i32(my_handle, NvsKey_Volume, &result);
-    if (err == ESP_OK)
+    if (settings_dirty)
     {
-        printf("odroid_settings_Volume_get: value=%d\n", result);
-    }
+        // Open
+        nvs_handle my_handle;
+        esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
+        if (err != ESP_OK) abort();
 
-    // Close
-    nvs_close(my_handle);
+        // Write keys
+        for (int i = 0; i < SETTING_COUNT; ++i)
+        {
+            if (!(settings_dirty & (1 << i))) continue;
+
+            if (i == SETTING_ROM_FILE_PATH)
+            {
+                if (settings_rom_file_path)
+                    err = nvs_set_str(my_handle, NvsKey_RomFilePath, settings_rom_file_path);
+                else
+                    err = nvs_erase_key(my_handle, NvsKey_RomFilePath);
+            }
+            else if (i == SETTING_ROM_PROFILE)
+            {
+                odroid_rom_profile stored;
+                rom_profile_copy(&stored, &rom_profile);
+                err = nvs_set_blob(my_handle, rom_profile_key, &stored, sizeof(stored));
+            }
+            else
+            {
+                err = nvs_set_i32(my_handle, *SettingKeys[i], settings[i]);
+            }
+
+            if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) abort();
+        }
+
+        err = nvs_commit(my_handle);
+        if (err != ESP_OK) abort();
 
-    return result;
-}
-void odroid_settings_Volume_set(int32_t value)
-{
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+        // Close
+        nvs_close(my_handle);
 
-    // Read
-    err = nvs_set_i32(my_handle, NvsKey_Volume, value);
-    if (err != ESP_OK) abort();
+        printf("%s: dirty=%#x\n", __func__, settings_dirty);
+        settings_dirty = 0;
+    }
 
-    // Close
-    nvs_close(my_handle);
+    xSemaphoreGive(settings_mutex);
 }
 
-
-char* odroid_settings_RomFilePath_get()
+// The ROM profile field that replaces a global setting, or NULL
+static int8_t* setting_override(int index)
 {
-    char* result = NULL;
-
-	// Open
-	nvs_handle my_handle;
-	esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-	if (err != ESP_OK) abort();
+    int8_t* field;
 
-
-	// Read
-    size_t required_size;
-    err = nvs_get_str(my_handle, NvsKey_RomFilePath, NULL, &required_size);
-    if (err == ESP_OK)
+    switch (index)
     {
-        char* value = malloc(required_size);
-        if (!value) abort();
-
-        err = nvs_get_str(my_handle, NvsKey_RomFilePath, value, &required_size);
-        if (err != ESP_OK) abort();
+        case SETTING_VOLUME:
+            field = &rom_profile.volume;
+            break;
 
-        result = value;
+        case SETTING_AUDIO_SINK:
+            field = &rom_profile.audioSink;
+            break;
 
-        printf("odroid_settings_RomFilePathGet: value='%s'\n", value);
+        default:
+            return NULL;
     }
 
-
-	// Close
-	nvs_close(my_handle);
-
-    return result;
+    return (*field != ODROID_PROFILE_INHERIT) ? field : NULL;
 }
-void odroid_settings_RomFilePath_set(char* value)
+
+static int32_t setting_get(int index)
 {
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+    if (!settings_mutex)
+    {
+        printf("odroid_settings_init not called before use.\n");
+        abort();
+    }
 
-    // Write key
-    err = nvs_set_str(my_handle, NvsKey_RomFilePath, value);
-    if (err != ESP_OK) abort();
+    int8_t* override = setting_override(index);
+    if (override) return *override;
 
-    // Close
-    nvs_close(my_handle);
+    // Aligned 32 bit reads are atomic
+    return settings[index];
 }
 
-
-int32_t odroid_settings_AppSlot_get()
+static void setting_set(int index, int32_t value)
 {
-    int32_t result = -1;
-
-	// Open
-	nvs_handle my_handle;
-	esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-	if (err != ESP_OK) abort();
+    if (!settings_mutex)
+    {
+        printf("odroid_settings_init not called before use.\n");
+        abort();
+    }
 
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
 
-	// Read
-	err = nvs_get_i32(my_handle, NvsKey_AppSlot, &result);
-	if (err == ESP_OK)
+    // A value the ROM profile overrides is changed in the profile
+    int8_t* override = setting_override(index);
+    if (override)
     {
-        printf("odroid_settings_AppSlot_get: value=%d\n", result);
-	}
+        if (*override != value)
+        {
+            *override = value;
+            settings_dirty |= 1 << SETTING_ROM_PROFILE;
+        }
+    }
+    else if (settings[index] != value)
+    {
+        settings[index] = value;
+        settings_dirty |= 1 << index;
+    }
 
+    xSemaphoreGive(settings_mutex);
+}
 
-	// Close
-	nvs_close(my_handle);
 
-    return result;
+int32_t odroid_settings_VRef_get()
+{
+    return setting_get(SETTING_VREF);
 }
-void odroid_settings_AppSlot_set(int32_t value)
+void odroid_settings_VRef_set(int32_t value)
 {
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+    setting_set(SETTING_VREF, value);
+}
 
-    // Write key
-    err = nvs_set_i32(my_handle, NvsKey_AppSlot, value);
-    if (err != ESP_OK) abort();
 
-    // Close
-    nvs_close(my_handle);
+int32_t odroid_settings_Volume_get()
+{
+    return setting_get(SETTING_VOLUME);
+}
+void odroid_settings_Volume_set(int32_t value)
+{
+    setting_set(SETTING_VOLUME, value);
 }
 
 
-int32_t odroid_settings_DataSlot_get()
+char* odroid_settings_RomFilePath_get()
 {
-    int32_t result = -1;
+    char* result = NULL;
 
-	// Open
-	nvs_handle my_handle;
-	esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-	if (err != ESP_OK) abort();
+    if (!settings_mutex) abort();
 
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
 
-	// Read
-	err = nvs_get_i32(my_handle, NvsKey_DataSlot, &result);
-	if (err == ESP_OK)
+    if (settings_rom_file_path)
     {
-        printf("odroid_settings_DataSlot_get: value=%d\n", result);
-	}
-
+        result = strdup(settings_rom_file_path);
+        if (!result) abort();
+    }
 
-	// Close
-	nvs_close(my_handle);
+    xSemaphoreGive(settings_mutex);
 
     return result;
 }
-void odroid_settings_DataSlot_set(int32_t value)
+void odroid_settings_RomFilePath_set(char* value)
 {
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+    char* copy = NULL;
+    if (value)
+    {
+        copy = strdup(value);
+        if (!copy) abort();
+    }
+
+    if (!settings_mutex) abort();
+
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
 
-    // Write key
-    err = nvs_set_i32(my_handle, NvsKey_DataSlot, value);
-    if (err != ESP_OK) abort();
+    free(settings_rom_file_path);
+    settings_rom_file_path = copy;
+    settings_dirty |= 1 << SETTING_ROM_FILE_PATH;
 
-    // Close
-    nvs_close(my_handle);
+    xSemaphoreGive(settings_mutex);
 }
 
 
-int32_t odroid_settings_Backlight_get()
+int32_t odroid_settings_AppSlot_get()
+{
+    return setting_get(SETTING_APP_SLOT);
+}
+void odroid_settings_AppSlot_set(int32_t value)
 {
-	// TODO: Move to header
-    int result = 2;
+    setting_set(SETTING_APP_SLOT, value);
+}
 
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
 
-    // Read
-    err = nvs_get_i32(my_handle, NvsKey_Backlight, &result);
-    if (err == ESP_OK)
-    {
-        printf("odroid_settings_Backlight_get: value=%d\n", result);
-    }
+int32_t odroid_settings_DataSlot_get()
+{
+    return setting_get(SETTING_DATA_SLOT);
+}
+void odroid_settings_DataSlot_set(int32_t value)
+{
+    setting_set(SETTING_DATA_SLOT, value);
+}
 
-    // Close
-    nvs_close(my_handle);
 
-    return result;
+int32_t odroid_settings_Backlight_get()
+{
+    return setting_get(SETTING_BACKLIGHT);
 }
 void odroid_settings_Backlight_set(int32_t value)
 {
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
-
-    // Read
-    err = nvs_set_i32(my_handle, NvsKey_Backlight, value);
-    if (err != ESP_OK) abort();
-
-    // Close
-    nvs_close(my_handle);
+    setting_set(SETTING_BACKLIGHT, value);
 }
 
 
 ODROID_START_ACTION odroid_settings_StartAction_get()
 {
-    int result = 0;
-
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
-
-    // Read
-    err = nvs_get_i32(my_handle, NvsKey_StartAction, &result);
-    if (err == ESP_OK)
-    {
-        printf("%s: value=%d\n", __func__, result);
-    }
-
-    // Close
-    nvs_close(my_handle);
-
-    return result;
+    return (ODROID_START_ACTION)setting_get(SETTING_START_ACTION);
 }
 void odroid_settings_StartAction_set(ODROID_START_ACTION value)
 {
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
-
-    // Write
-    err = nvs_set_i32(my_handle, NvsKey_StartAction, value);
-    if (err != ESP_OK) abort();
-
-    // Close
-    nvs_close(my_handle);
+    setting_set(SETTING_START_ACTION, value);
 }
 
 
 uint8_t odroid_settings_ScaleDisabled_get(ODROID_SCALE_DISABLE system)
 {
-    int result = 0;
-
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+    if (rom_profile.scaleDisabled != ODROID_PROFILE_INHERIT)
+        return rom_profile.scaleDisabled;
 
-    // Read
-    err = nvs_get_i32(my_handle, NvsKey_ScaleDisabled, &result);
-    if (err == ESP_OK)
-    {
-        printf("%s: result=%d\n", __func__, result);
-    }
-
-    // Close
-    nvs_close(my_handle);
-
-    return (result & system) ? 1 : 0;
+    return (setting_get(SETTING_SCALE_DISABLED) & system) ? 1 : 0;
 }
 void odroid_settings_ScaleDisabled_set(ODROID_SCALE_DISABLE system, uint8_t value)
 {
 	printf("%s: system=%#010x, value=%d\n", __func__, system, value);
 
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+    if (!settings_mutex) abort();
 
-	// Read
-	int result = 0;
-	err = nvs_get_i32(my_handle, NvsKey_ScaleDisabled, &result);
-	if (err == ESP_OK)
-	{
-		printf("%s: result=%d\n", __func__, result);
-	}
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
+
+    // Scaling is chosen per game once a ROM profile is loaded
+    if (rom_profile_key[0])
+    {
+        if (rom_profile.scaleDisabled != (value ? 1 : 0))
+        {
+            rom_profile.scaleDisabled = value ? 1 : 0;
+            settings_dirty |= 1 << SETTING_ROM_PROFILE;
+        }
+
+        xSemaphoreGive(settings_mutex);
+        return;
+    }
 
 	// set system flag
-	//result = 1;
+	int32_t result = settings[SETTING_SCALE_DISABLED];
 	result &= ~system;
-	//printf("%s: result=%d\n", __func__, result);
 	result |= (system & (value ? 0xffffffff : 0));
 	printf("%s: set result=%d\n", __func__, result);
 
-    // Write
-    err = nvs_set_i32(my_handle, NvsKey_ScaleDisabled, result);
-    if (err != ESP_OK) abort();
+    if (settings[SETTING_SCALE_DISABLED] != result)
+    {
+        settings[SETTING_SCALE_DISABLED] = result;
+        settings_dirty |= 1 << SETTING_SCALE_DISABLED;
+    }
 
-    // Close
-    nvs_close(my_handle);
+    xSemaphoreGive(settings_mutex);
 }
 
 
 ODROID_AUDIO_SINK odroid_settings_AudioSink_get()
 {
-    int result = ODROID_AUDIO_SINK_SPEAKER;
+    return (ODROID_AUDIO_SINK)setting_get(SETTING_AUDIO_SINK);
+}
+void odroid_settings_AudioSink_set(ODROID_AUDIO_SINK value)
+{
+    setting_set(SETTING_AUDIO_SINK, (int32_t)value);
+}
 
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
 
-    // Read
-    err = nvs_get_i32(my_handle, NvsKey_AudioSink, &result);
-    if (err == ESP_OK)
+bool odroid_settings_RomProfile_load(uint32_t crc)
+{
+    if (!settings_mutex || rom_profile_key[0]) abort();
+
+    snprintf(rom_profile_key, sizeof(rom_profile_key), NvsKeyFormat_RomProfile, crc);
+
+	// Open
+	nvs_handle my_handle;
+	esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
+	if (err != ESP_OK) abort();
+
+	// Read, ignoring a profile stored with a different layout. Profiles
+	// stored before idleSkip was added still load with it inherited.
+    odroid_rom_profile value;
+    size_t required_size = sizeof(value);
+    err = nvs_get_blob(my_handle, rom_profile_key, &value, &required_size);
+
+    bool found = (err == ESP_OK && (required_size == sizeof(value) ||
+        required_size == offsetof(odroid_rom_profile, idleSkip)));
+    if (found)
     {
-        printf("%s: value=%d\n", __func__, result);
+        if (required_size < sizeof(value))
+            value.idleSkip = ODROID_PROFILE_INHERIT;
+
+        // Out of range fields inherit, as odroid_framepace_frameskip_set
+        // and odroid_audio_volume_set abort on them
+        if (value.audioSampleRate < 8000 || value.audioSampleRate > 48000)
+            value.audioSampleRate = 0;
+        if (value.frameSkip < ODROID_PROFILE_INHERIT)
+            value.frameSkip = ODROID_PROFILE_INHERIT;
+        if (value.volume < ODROID_PROFILE_INHERIT || value.volume >= ODROID_VOLUME_LEVEL_COUNT)
+            value.volume = ODROID_PROFILE_INHERIT;
+        if (value.idleSkip < ODROID_PROFILE_INHERIT || value.idleSkip > 1)
+            value.idleSkip = ODROID_PROFILE_INHERIT;
+
+        rom_profile_copy(&rom_profile, &value);
+
+        printf("%s: %s scaleDisabled=%d, audioSink=%d, volume=%d, frameSkip=%d, audioSampleRate=%d, idleSkip=%d\n",
+            __func__, rom_profile_key, value.scaleDisabled, value.audioSink, value.volume,
+            value.frameSkip, value.audioSampleRate, value.idleSkip);
     }
 
-    // Close
-    nvs_close(my_handle);
+	// Close
+	nvs_close(my_handle);
 
-    return (ODROID_AUDIO_SINK)result;
+    return found;
 }
-void odroid_settings_AudioSink_set(ODROID_AUDIO_SINK value)
+
+void odroid_settings_RomProfile_get(odroid_rom_profile* out_value)
+{
+    if (!settings_mutex) abort();
+
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
+    *out_value = rom_profile;
+    xSemaphoreGive(settings_mutex);
+}
+
+void odroid_settings_RomProfile_set(const odroid_rom_profile* value)
 {
-    // Open
-    nvs_handle my_handle;
-    esp_err_t err = nvs_open(NvsNamespace, NVS_READWRITE, &my_handle);
-    if (err != ESP_OK) abort();
+    if (!settings_mutex || !rom_profile_key[0]) abort();
+
+    xSemaphoreTake(settings_mutex, portMAX_DELAY);
+
+    odroid_rom_profile copy;
+    rom_profile_copy(&copy, value);
 
-    // Write
-    err = nvs_set_i32(my_handle, NvsKey_AudioSink, (int)value);
-    if (err != ESP_OK) abort();
+    if (memcmp(&rom_profile, &copy, sizeof(rom_profile)) != 0)
+    {
+        memcpy(&rom_profile, &copy, sizeof(rom_profile));
+        settings_dirty |= 1 << SETTING_ROM_PROFILE;
+    }
 
-    // Close
-    nvs_close(my_handle);
+    xSemaphoreGive(settings_mutex);
 }
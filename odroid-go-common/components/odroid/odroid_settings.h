@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 char* odroid_util_GetFileName(const char* path);
 char* odroid_util_GetFileExtenstion(const char* path);
@@ -27,6 +28,13 @@ typedef enum
 } ODROID_AUDIO_SINK;
 
 
+// Reads every setting into RAM. Call once after nvs_flash_init.
+void odroid_settings_init();
+
+// Writes the settings changed since the last commit to flash. Sets only
+// update RAM until then.
+void odroid_settings_commit();
+
 int32_t odroid_settings_VRef_get();
 void odroid_settings_VRef_set(int32_t value);
 
@@ -53,3 +61,28 @@ void odroid_settings_ScaleDisabled_set(ODROID_SCALE_DISABLE system, uint8_t valu
 
 ODROID_AUDIO_SINK odroid_settings_AudioSink_get();
 void odroid_settings_AudioSink_set(ODROID_AUDIO_SINK value);
+
+
+#define ODROID_PROFILE_INHERIT (-1)
+
+// Settings for one ROM. Fields at ODROID_PROFILE_INHERIT use the global
+// setting or the emulator's default.
+typedef struct
+{
+    int8_t scaleDisabled;
+    int8_t audioSink;           // ODROID_AUDIO_SINK
+    int8_t volume;              // odroid_volume_level
+    int8_t frameSkip;           // see odroid_framepace_frameskip_set
+    int32_t audioSampleRate;    // Hz, 0 for the emulator's default
+    int8_t idleSkip;            // 1 to skip busy-wait loops, 0 to never skip them
+} odroid_rom_profile;
+
+// Selects the profile of the running ROM by its CRC32. Returns false when
+// none is stored; the profile then starts with every field inherited.
+// ROMs that give the same CRC, for example when it covers only part of
+// the image, share a profile. Stored fields out of range are inherited.
+// From here on ScaleDisabled, AudioSink and Volume read the profile where
+// it overrides them, and a scaling change is stored in the profile.
+bool odroid_settings_RomProfile_load(uint32_t crc);
+void odroid_settings_RomProfile_get(odroid_rom_profile* out_value);
+void odroid_settings_RomProfile_set(const odroid_rom_profile* value);
@@ -8,11 +8,15 @@
 #include "esp_ota_ops.h"
 
 #include "odroid_input.h"
+#include "odroid_settings.h"
 
 static bool system_initialized = false;
 
 void odroid_system_application_set(int slot)
 {
+    // Always followed by a restart
+    odroid_settings_commit();
+
     const esp_partition_t* partition = esp_partition_find_first(
         ESP_PARTITION_TYPE_APP,
         ESP_PARTITION_SUBTYPE_APP_OTA_MIN + slot,
@@ -44,6 +48,8 @@ void odroid_system_sleep()
 
     //odroid_input_gamepad_terminate();
 
+    odroid_settings_commit();
+
 
     // Configure button to wake
     printf("odroid_system_sleep: Configuring deep sleep.\n");
@@ -0,0 +1,161 @@
+// Host test for the odroid_audio sample conversion. The fixed point path
+// must match the float code it replaced bit for bit.
+//
+//   make -C odroid-go-common/components/odroid/test
+
+#include "odroid_audio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static int volumeLevels[] = {0, 125, 250, 500, 1000};
+
+static int failures;
+
+
+// The float conversion as it was before the fixed point gains. Float to
+// uint16_t goes through int, as the ESP32 compiler does.
+static void float_convert(ODROID_AUDIO_SINK sink, float Volume, short* stereoAudioBuffer, int frameCount)
+{
+    short currentAudioSampleCount = frameCount * 2;
+
+    if (sink == ODROID_AUDIO_SINK_SPEAKER)
+    {
+        for (short i = 0; i < currentAudioSampleCount; i += 2)
+        {
+            uint16_t dac0;
+            uint16_t dac1;
+
+            if (Volume == 0.0f)
+            {
+                // Disable amplifier
+                dac0 = 0;
+                dac1 = 0;
+            }
+            else
+            {
+                // Down mix stero to mono
+                int32_t sample = stereoAudioBuffer[i];
+                sample += stereoAudioBuffer[i + 1];
+                sample >>= 1;
+
+                // Normalize
+                const float sn = (float)sample / 0x8000;
+
+                // Scale
+                const int magnitude = 127 + 127;
+                const float range = magnitude  * sn * Volume;
+
+                // Convert to differential output
+                if (range > 127)
+                {
+                    dac1 = (int)(range - 127);
+                    dac0 = 127;
+                }
+                else if (range < -127)
+                {
+                    dac1  = (int)(range + 127);
+                    dac0 = -127;
+                }
+                else
+                {
+                    dac1 = 0;
+                    dac0 = (int)range;
+                }
+
+                dac0 += 0x80;
+                dac1 = 0x80 - dac1;
+
+                dac0 <<= 8;
+                dac1 <<= 8;
+            }
+
+            stereoAudioBuffer[i] = (int16_t)dac1;
+            stereoAudioBuffer[i + 1] = (int16_t)dac0;
+        }
+    }
+    else
+    {
+        for (short i = 0; i < currentAudioSampleCount; ++i)
+        {
+            int sample = stereoAudioBuffer[i] * Volume;
+
+            if (sample > 32767)
+                sample = 32767;
+            else if (sample < -32768)
+                sample = -32767;
+
+            stereoAudioBuffer[i] = (short)sample;
+        }
+    }
+}
+
+// Every left sample, with the right one the same, negated or random
+#define FRAME_COUNT (65536)
+#define CHUNK_FRAMES (512)
+
+static void fill(short* buffer, int pairing)
+{
+    for (int i = 0; i < FRAME_COUNT; ++i)
+    {
+        const short left = (short)(i - 32768);
+        short right;
+
+        switch (pairing)
+        {
+            case 0: right = left; break;
+            case 1: right = (short)(-left); break;
+            default: right = (short)(rand() & 0xffff); break;
+        }
+
+        buffer[i * 2] = left;
+        buffer[i * 2 + 1] = right;
+    }
+}
+
+static void test_bit_identical(ODROID_AUDIO_SINK sink)
+{
+    // Buffers are read as 32 bit frames
+    static uint32_t expected[FRAME_COUNT];
+    static uint32_t actual[FRAME_COUNT];
+
+    for (int level = 0; level < ODROID_VOLUME_LEVEL_COUNT; ++level)
+    {
+        odroid_audio_volume_set(level);
+        const float volume = (float)volumeLevels[level] * 0.001f;
+
+        for (int pairing = 0; pairing < 3; ++pairing)
+        {
+            srand(level * 3 + pairing);
+            fill((short*)expected, pairing);
+            memcpy(actual, expected, sizeof(actual));
+
+            // The old code counted samples in a short
+            for (int i = 0; i < FRAME_COUNT; i += CHUNK_FRAMES)
+                float_convert(sink, volume, (short*)(expected + i), CHUNK_FRAMES);
+            odroid_audio_convert(sink, (short*)actual, FRAME_COUNT);
+
+            for (int i = 0; i < FRAME_COUNT; ++i)
+            {
+                if (actual[i] != expected[i])
+                {
+                    printf("%s: sink %d, level %d, pairing %d, frame %d: %#010x != %#010x\n",
+                        __func__, sink, level, pairing, i, actual[i], expected[i]);
+                    ++failures;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    test_bit_identical(ODROID_AUDIO_SINK_SPEAKER);
+    test_bit_identical(ODROID_AUDIO_SINK_DAC);
+
+    printf("audio: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
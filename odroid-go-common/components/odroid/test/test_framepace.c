@@ -0,0 +1,229 @@
+// Host test for odroid_framepace, driven by a simulated clock.
+//
+//   make -C odroid-go-common/components/odroid/test
+
+#include "odroid_framepace.h"
+
+#include <stdio.h>
+
+
+#define CLOCK_RATE (1000000)
+#define FPS (50.0f)
+#define FRAME_CYCLES (CLOCK_RATE / 50)
+
+// The clock moves one cycle per read so that waiting loops end
+static uint32_t fake_now;
+static uint32_t fake_clock()
+{
+    return fake_now++;
+}
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__, __func__, #cond); ++failures; } } while (0)
+
+
+typedef struct
+{
+    int presented;
+    int dropped;
+    int maxDropRun;
+    uint32_t minPeriod;         // shortest time between frame starts
+    uint32_t maxPeriod;
+} run_result;
+
+// Stands in for the display task. It presents the newest pending frame
+// when it is idle, taking presentCycles for each.
+typedef struct
+{
+    uint32_t presentCycles;
+    bool busy;
+    bool pending;
+    uint32_t done;
+} display_sim;
+
+static void display_at(odroid_framepace* pace, display_sim* display, uint32_t time)
+{
+    uint32_t now = fake_now;
+
+    fake_now = time;
+    odroid_framepace_present_begin(pace);
+    display->busy = true;
+    display->pending = false;
+    display->done = time + display->presentCycles;
+
+    fake_now = now;
+}
+
+static void display_run(odroid_framepace* pace, display_sim* display)
+{
+    uint32_t now = fake_now;
+
+    while (display->busy && (int32_t)(now - display->done) >= 0)
+    {
+        fake_now = display->done;
+        odroid_framepace_present_end(pace);
+        display->busy = false;
+
+        if (display->pending)
+            display_at(pace, display, display->done);
+    }
+
+    fake_now = now;
+
+    if (!display->busy && display->pending)
+        display_at(pace, display, now);
+}
+
+// Runs frames that take emulateCycles to emulate, plus renderCycles more
+// when presented
+static run_result run(odroid_framepace* pace, int frames, uint32_t emulateCycles, uint32_t renderCycles, uint32_t presentCycles)
+{
+    run_result result = { 0, 0, 0, UINT32_MAX, 0 };
+    display_sim display = { presentCycles, false, false, 0 };
+    uint32_t lastStart = 0;
+    int dropRun = 0;
+
+    for (int i = 0; i < frames; ++i)
+    {
+        display_run(pace, &display);
+
+        ODROID_FRAME_ACTION action = odroid_framepace_frame_begin(pace);
+
+        if (i > 0)
+        {
+            uint32_t period = pace->frameStart - lastStart;
+            if (period < result.minPeriod) result.minPeriod = period;
+            if (period > result.maxPeriod) result.maxPeriod = period;
+        }
+        lastStart = pace->frameStart;
+
+        fake_now += emulateCycles;
+
+        if (action == ODROID_FRAME_PRESENT)
+        {
+            fake_now += renderCycles;
+            ++result.presented;
+            dropRun = 0;
+
+            display.pending = true;
+            display_run(pace, &display);
+        }
+        else
+        {
+            ++result.dropped;
+            if (++dropRun > result.maxDropRun) result.maxDropRun = dropRun;
+        }
+    }
+
+    return result;
+}
+
+static void init(odroid_framepace* pace)
+{
+    fake_now = 12345;
+    odroid_framepace_init(pace, FPS, CLOCK_RATE, fake_clock);
+}
+
+
+// Fast emulation is held to the frame rate and presents every frame
+static void test_on_time()
+{
+    odroid_framepace pace;
+    init(&pace);
+
+    run_result r = run(&pace, 200, FRAME_CYCLES / 4, FRAME_CYCLES / 4, FRAME_CYCLES / 2);
+
+    CHECK(r.presented == 200);
+    CHECK(r.dropped == 0);
+    CHECK(r.minPeriod >= FRAME_CYCLES - 4);
+    CHECK(r.maxPeriod <= FRAME_CYCLES + 4);
+}
+
+// Rendering makes frames too slow; dropping them keeps up
+static void test_behind_drops()
+{
+    odroid_framepace pace;
+    init(&pace);
+
+    run_result r = run(&pace, 300, FRAME_CYCLES / 2, FRAME_CYCLES, FRAME_CYCLES / 2);
+
+    CHECK(r.dropped > 0);
+    CHECK(r.presented > 0);
+    CHECK(r.maxDropRun <= 4);
+
+    // Emulated time keeps up with real time
+    CHECK(pace.lag <= FRAME_CYCLES * 2);
+}
+
+// A display slower than the frame rate makes frames drop while it is busy
+static void test_slow_display()
+{
+    odroid_framepace pace;
+    init(&pace);
+
+    run_result r = run(&pace, 300, FRAME_CYCLES / 4, FRAME_CYCLES / 4, FRAME_CYCLES * 5 / 2);
+
+    CHECK(r.dropped > r.presented);
+    CHECK(r.presented >= 300 / 5);
+    CHECK(r.maxDropRun <= 4);
+    CHECK(r.minPeriod >= FRAME_CYCLES - 4);
+}
+
+// A fixed skip presents one frame in every n + 1, whatever the timing
+static void test_fixed_frameskip()
+{
+    odroid_framepace pace;
+    init(&pace);
+    odroid_framepace_frameskip_set(&pace, 2);
+
+    for (int i = 0; i < 30; ++i)
+    {
+        ODROID_FRAME_ACTION action = odroid_framepace_frame_begin(&pace);
+        CHECK(action == ((i % 3) == 2 ? ODROID_FRAME_PRESENT : ODROID_FRAME_DROP));
+        fake_now += (i & 1) ? FRAME_CYCLES * 2 : FRAME_CYCLES / 4;
+    }
+
+    CHECK(pace.framesPresented == 10);
+    CHECK(pace.framesDropped == 20);
+}
+
+// No skip presents every frame and slows down instead
+static void test_no_frameskip()
+{
+    odroid_framepace pace;
+    init(&pace);
+    odroid_framepace_frameskip_set(&pace, ODROID_FRAMESKIP_NONE);
+
+    run_result r = run(&pace, 100, FRAME_CYCLES, FRAME_CYCLES, FRAME_CYCLES * 3);
+
+    CHECK(r.presented == 100);
+    CHECK(r.dropped == 0);
+}
+
+// A long stall is forgiven rather than caught up by dropping frames
+static void test_stall_forgiven()
+{
+    odroid_framepace pace;
+    init(&pace);
+
+    run(&pace, 10, FRAME_CYCLES / 4, FRAME_CYCLES / 4, FRAME_CYCLES / 2);
+    fake_now += FRAME_CYCLES * 100;
+    run_result r = run(&pace, 10, FRAME_CYCLES / 4, FRAME_CYCLES / 4, FRAME_CYCLES / 2);
+
+    CHECK(r.dropped == 0);
+}
+
+int main()
+{
+    test_on_time();
+    test_behind_drops();
+    test_slow_display();
+    test_fixed_frameskip();
+    test_no_frameskip();
+    test_stall_forgiven();
+
+    printf("framepace: %s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -21,6 +21,7 @@
  ******************************************************************************/
 
 #include "shared.h"
+#include "../odroid/odroid_sdcard.h"
 
 extern unsigned long crc32(crc, buf, len);
 
@@ -408,13 +409,13 @@ int load_rom (char *filename)
     if (cart.size < 0x4000) cart.size = 0x4000;
 
     cart.rom = ESP32_PSRAM;
-    size_t cnt = fread(cart.rom, cart.size, 1, fd);
-    //if (cnt != 1) abort();
-    __asm__("nop");
-    __asm__("nop");
-    __asm__("nop");
-    __asm__("nop");
-    __asm__("memw");
+    size_t cnt = odroid_sdcard_read(fd, 0, cart.rom, actual_size);
+    printf("%s: read %u bytes.\n", __func__, (unsigned)cnt);
+    if (cnt != actual_size)
+    {
+        printf("%s: read failed.\n", __func__);
+        abort();
+    }
 
     fclose(fd);
 
@@ -18,6 +18,8 @@
 #include "../components/odroid/odroid_system.h"
 #include "../components/odroid/odroid_display.h"
 #include "../components/odroid/odroid_sdcard.h"
+#include "../components/odroid/odroid_framepace.h"
+#include "../components/odroid/odroid_framemailbox.h"
 
 #include <dirent.h>
 
@@ -26,19 +28,19 @@ const char* SD_BASE_PATH = "/sd";
 #define AUDIO_SAMPLE_RATE (32000)
 
 uint16 palette[PALETTE_SIZE];
-uint8_t* framebuffer[2];
-int currentFramebuffer = 0;
+uint8_t* framebuffer[ODROID_FRAMEMAILBOX_SLOTS];
+odroid_framemailbox frameMailbox;
 
 uint32_t* audioBuffer = NULL;
 int audioBufferCount = 0;
 
 spi_flash_mmap_handle_t hrom;
 
-QueueHandle_t vidQueue;
 TaskHandle_t videoTaskHandle;
 
 odroid_volume_level Volume;
 odroid_battery_state battery;
+odroid_framepace framePace;
 
 bool scaling_enabled = true;
 bool previous_scaling_enabled = true;
@@ -54,23 +56,27 @@ void videoTask(void *arg)
 
     while(1)
     {
-        xQueuePeek(vidQueue, &param, portMAX_DELAY);
+        int slot = odroid_framemailbox_acquire(&frameMailbox);
 
-        if (param == 1)
+        if (slot < 0)
             break;
 
+        param = framebuffer[slot];
+
         if (previous_scaling_enabled != scaling_enabled)
         {
             ili9341_write_frame_sms(NULL, NULL, isGameGear, false);
             previous_scaling_enabled = scaling_enabled;
         }
 
+        odroid_framepace_present_begin(&framePace);
+
         render_copy_palette(palette);
         ili9341_write_frame_sms(param, palette, isGameGear, scaling_enabled);
 
-        odroid_input_battery_level_read(&battery);
+        odroid_framepace_present_end(&framePace);
 
-        xQueueReceive(vidQueue, &param, portMAX_DELAY);
+        odroid_input_battery_level_read(&battery);
     }
 
     odroid_display_lock_sms_display();
@@ -131,11 +137,16 @@ static void SaveState()
         //     abort();
         // }
 
-        FILE* f = fopen(pathName, "w");
+        // Scripted runs always start from power on
+        FILE* f = NULL;
+        if (odroid_input_script_mode_get() != ODROID_INPUT_SCRIPT_NONE)
+            odroid_input_script_save();
+        else
+            f = fopen(pathName, "w");
 
         if (f == NULL)
         {
-            printf("SaveState: fopen save failed\n");
+            printf("SaveState: no state saved\n");
         }
         else
         {
@@ -199,7 +210,10 @@ static void LoadState(const char* cartName)
         //     abort();
         // }
 
-        FILE* f = fopen(pathName, "r");
+        FILE* f = NULL;
+        if (odroid_input_script_init(SD_BASE_PATH, romName) == ODROID_INPUT_SCRIPT_NONE)
+            f = fopen(pathName, "r");
+
         if (f == NULL)
         {
             printf("LoadState: fopen load failed\n");
@@ -246,8 +260,6 @@ static void LoadState(const char* cartName)
 
 static void PowerDown()
 {
-    uint16_t* param = 1;
-
     // Clear audio to prevent studdering
     printf("PowerDown: stopping audio.\n");
     odroid_audio_terminate();
@@ -255,7 +267,7 @@ static void PowerDown()
     // Stop tasks
     printf("PowerDown: stopping tasks.\n");
 
-    xQueueSend(vidQueue, &param, portMAX_DELAY);
+    odroid_framemailbox_close(&frameMailbox);
     while (videoTaskIsRunning) { vTaskDelay(1); }
 
 
@@ -276,7 +288,6 @@ static void PowerDown()
 static void DoHome()
 {
     esp_err_t err;
-    uint16_t* param = 1;
 
     // Clear audio to prevent studdering
     printf("PowerDown: stopping audio.\n");
@@ -286,7 +297,7 @@ static void DoHome()
     // Stop tasks
     printf("PowerDown: stopping tasks.\n");
 
-    xQueueSend(vidQueue, &param, portMAX_DELAY);
+    odroid_framemailbox_close(&frameMailbox);
     while (videoTaskIsRunning) { vTaskDelay(1); }
 
 
@@ -314,17 +325,18 @@ void app_main(void)
 {
     printf("smsplusgx (%s-%s).\n", COMPILEDATE, GITREV);
 
-    framebuffer[0] = heap_caps_malloc(256 * 192, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-    if (!framebuffer[0]) abort();
-    printf("app_main: framebuffer[0]=%p\n", framebuffer[0]);
-
-    framebuffer[1] = heap_caps_malloc(256 * 192, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-    if (!framebuffer[1]) abort();
-    printf("app_main: framebuffer[1]=%p\n", framebuffer[1]);
+    for (int i = 0; i < ODROID_FRAMEMAILBOX_SLOTS; ++i)
+    {
+        framebuffer[i] = heap_caps_malloc(256 * 192, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
+        if (!framebuffer[i]) abort();
+        printf("app_main: framebuffer[%d]=%p\n", i, framebuffer[i]);
+    }
 
 
     nvs_flash_init();
 
+    odroid_settings_init();
+
     odroid_system_init();
 
     // Joystick.
@@ -401,6 +413,7 @@ void app_main(void)
     {
         forceConsoleReset = true;
         odroid_settings_StartAction_set(ODROID_START_ACTION_NORMAL);
+        odroid_settings_commit();
     }
 
 
@@ -539,12 +552,21 @@ void app_main(void)
 
 
 
+    // Per-ROM settings
+    odroid_settings_RomProfile_load(cart.crc);
+
+    odroid_rom_profile profile;
+    odroid_settings_RomProfile_get(&profile);
+
+    const int audioSampleRate = profile.audioSampleRate ? profile.audioSampleRate : AUDIO_SAMPLE_RATE;
+
+
     ili9341_write_frame_sms(NULL, NULL, false, false);
 
-    odroid_audio_init(odroid_settings_AudioSink_get(), AUDIO_SAMPLE_RATE);
+    odroid_audio_init(odroid_settings_AudioSink_get(), audioSampleRate);
 
 
-    vidQueue = xQueueCreate(1, sizeof(uint16_t*));
+    odroid_framemailbox_init(&frameMailbox, framebuffer[0], framebuffer[1], framebuffer[2]);
     xTaskCreatePinnedToCore(&videoTask, "videoTask", 1024 * 4, NULL, 5, &videoTaskHandle, 1);
 
 
@@ -567,7 +589,7 @@ void app_main(void)
 	bitmap.height = 192;
 	bitmap.pitch = bitmap.width;
 	//bitmap.depth = 8;
-    bitmap.data = framebuffer[0];
+    bitmap.data = framebuffer[odroid_framemailbox_back_get(&frameMailbox)];
 
     // cart.pages = (cartSize / 0x4000);
     // cart.rom = romAddress;
@@ -576,7 +598,7 @@ void app_main(void)
     //system_init2(AUDIO_SAMPLE_RATE);
     set_option_defaults();
 
-    option.sndrate = AUDIO_SAMPLE_RATE;
+    option.sndrate = audioSampleRate;
     option.overscan = 0;
     option.extra_gg = 0;
 
@@ -596,7 +618,7 @@ void app_main(void)
 
 
     odroid_gamepad_state previousState;
-    odroid_input_gamepad_read(&previousState);
+    odroid_input_events_begin(&previousState);
 
     uint startTime;
     uint stopTime;
@@ -609,10 +631,14 @@ void app_main(void)
 
     scaling_enabled = odroid_settings_ScaleDisabled_get(ODROID_SCALE_DISABLE_SMS) ? false : true;
 
+    odroid_framepace_init(&framePace, (sms.display == DISPLAY_PAL) ? 50 : 60,
+        CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000, NULL);
+    odroid_framepace_frameskip_set(&framePace, profile.frameSkip);
+
     while (true)
     {
-        odroid_gamepad_state joystick;
-        odroid_input_gamepad_read(&joystick);
+        odroid_gamepad_state joystick = previousState;
+        odroid_input_events_apply(&joystick);
 
         if (ignoreMenuButton)
         {
@@ -748,14 +774,11 @@ void app_main(void)
             }
         }
 
-        if (0 || (frame % 2) == 0)
+        if (odroid_framepace_frame_begin(&framePace) == ODROID_FRAME_PRESENT)
         {
             system_frame(0);
 
-            xQueueSend(vidQueue, &bitmap.data, portMAX_DELAY);
-
-            currentFramebuffer = currentFramebuffer ? 0 : 1;
-            bitmap.data = framebuffer[currentFramebuffer];
+            bitmap.data = framebuffer[odroid_framemailbox_publish(&frameMailbox)];
         }
         else
         {
@@ -824,7 +847,29 @@ void app_main(void)
           float fps = frame / seconds;
 
 
-          printf("HEAP:0x%x, FPS:%f, BATTERY:%d [%d]\n", esp_get_free_heap_size(), fps, battery.millivolts, battery.percentage);
+          printf("HEAP:0x%x, FPS:%f, BATTERY:%d [%d], SKIP:%d\n", esp_get_free_heap_size(), fps, battery.millivolts, battery.percentage, odroid_display_delta_skipped_lines_get());
+
+          odroid_display_stats displayStats;
+          odroid_display_stats_get(&displayStats);
+          printf("DISPLAY: FRAMES:%d, LINEWAIT:%dus, SPIWAIT:%dus, DEPTH:%.2f [%d]\n", displayStats.frames,
+              displayStats.lineWaitMicros, displayStats.spiWaitMicros, displayStats.depthAverage, displayStats.depthMax);
+
+          printf("PACE: PRESENTED:%d, DROPPED:%d\n", framePace.framesPresented, framePace.framesDropped);
+          framePace.framesPresented = 0;
+          framePace.framesDropped = 0;
+
+          odroid_framemailbox_stats mailboxStats;
+          odroid_framemailbox_stats_get(&frameMailbox, &mailboxStats);
+          printf("MAILBOX: PRESENTED:%d, DROPPED:%d\n", mailboxStats.framesPresented, mailboxStats.framesDropped);
+
+          odroid_audio_stats audioStats;
+          odroid_audio_stats_get(&audioStats);
+          printf("AUDIO: FILL:%d/%d [%d], UNDERRUNS:%d, OVERRUNS:%d, DROPPED:%d, RATE:%+dppm\n", audioStats.fill, audioStats.capacity,
+              audioStats.fillMin, audioStats.underruns, audioStats.overruns, audioStats.droppedFrames, audioStats.rateAdjustPpm);
+
+          odroid_input_stats inputStats;
+          odroid_input_stats_get(&inputStats);
+          printf("INPUT: EVENTS:%d, DROPPED:%d, LATENCY:%dus\n", inputStats.events, inputStats.dropped, inputStats.latencyMicros);
 
           frame = 0;
           totalElapsedTime = 0;